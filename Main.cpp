@@ -1,14 +1,48 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <cmath>
+#include <cctype>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
 
-int e462counter = 0;
 using namespace std;
 
 uint8_t RAM[2048];
-uint8_t ROM[32768];
+const uint32_t PrgWindowSize = 0x8000; // CPU address space given to PRG ROM
+uint8_t blankROM[PrgWindowSize]; // Mapped until a cartridge is loaded
+uint8_t* ROM = blankROM; // PRG of the loaded cartridge, shared by every run of it
+uint32_t prgSize = PrgWindowSize; // PRG ROM size in bytes, 16k carts are mirrored at 0xC000
 uint8_t PPU[8];
-uint8_t SaveWorkRAM[8191];
+uint8_t OAM[256];
+const uint32_t SaveWorkRAMSize = 8192;
+uint8_t workRAM[SaveWorkRAMSize]; // Anonymous memory for carts without a battery
+uint8_t* SaveWorkRAM = workRAM; // $6000-$7FFF, mapped from the .sav file of battery carts
+uint8_t powerOnRamValue; // Internal RAM contents at power on
+uint64_t romHash; // Hash of the ROM file, movies are checked against it
 
 // Registers
 uint8_t A; // Accumulator
@@ -16,13 +50,15 @@ uint8_t X; // Index
 uint8_t Y; // Index
 uint16_t PC; // Program Counter
 uint8_t SP; // Stack Pointer
+uint64_t cycles; // CPU cycles since power on
+uint64_t frameCount; // Frames completed
 //uint8_t P; // Status // 5th bit should be 1
 
 // Status Register
 uint8_t C, Z, I, D, B, V, N; // Carry Flag, Zero Flag, Interrupt Disable, Decimal Mode Flag, Break Command, Overflow Flag, Negative Flag
 
-const char* szInstruction;
 uint16_t logAddress;
+uint8_t logOpcode;
 uint8_t operands[3];
 
 enum AddressingMode
@@ -39,1893 +75,8974 @@ enum AddressingMode
 	ABSOLUTEY,
 	INDIRECT,
 	INDIRECTX,
-	INDIRECTY
+	INDIRECTY,
+	ZEROPAGEINDIRECT,
+	ABSOLUTEINDEXEDINDIRECT
 };
 
-AddressingMode addressingMode;
+const uint8_t ModeLengths[15] = { 1, 1, 2, 2, 2, 2, 2, 3, 3, 3, 3, 2, 2, 2, 3 };
 
-void SetInstruction(char* szName)
+// Mnemonic of each opcode, ??? for the unofficial ones
+const char* const OpcodeNames[256] =
 {
-	szInstruction = szName;
+	"BRK", "ORA", "???", "???", "???", "ORA", "ASL", "???", "PHP", "ORA", "ASL", "???", "???", "ORA", "ASL", "???",
+	"BPL", "ORA", "???", "???", "???", "ORA", "ASL", "???", "CLC", "ORA", "???", "???", "???", "ORA", "ASL", "???",
+	"JSR", "AND", "???", "???", "BIT", "AND", "ROL", "???", "PLP", "AND", "ROL", "???", "BIT", "AND", "ROL", "???",
+	"BMI", "AND", "???", "???", "???", "AND", "ROL", "???", "SEC", "AND", "???", "???", "???", "AND", "ROL", "???",
+	"RTI", "EOR", "???", "???", "???", "EOR", "LSR", "???", "PHA", "EOR", "LSR", "???", "JMP", "EOR", "LSR", "???",
+	"BVC", "EOR", "???", "???", "???", "EOR", "LSR", "???", "CLI", "EOR", "???", "???", "???", "EOR", "LSR", "???",
+	"RTS", "ADC", "???", "???", "???", "ADC", "ROR", "???", "PLA", "ADC", "ROR", "???", "JMP", "ADC", "ROR", "???",
+	"BVS", "ADC", "???", "???", "???", "ADC", "ROR", "???", "SEI", "ADC", "???", "???", "???", "ADC", "ROR", "???",
+	"???", "STA", "???", "???", "STY", "STA", "STX", "???", "DEY", "???", "TXA", "???", "STY", "STA", "STX", "???",
+	"BCC", "STA", "???", "???", "STY", "STA", "STX", "???", "TYA", "STA", "TXS", "???", "???", "STA", "???", "???",
+	"LDY", "LDA", "LDX", "???", "LDY", "LDA", "LDX", "???", "TAY", "LDA", "TAX", "???", "LDY", "LDA", "LDX", "???",
+	"BCS", "LDA", "???", "???", "LDY", "LDA", "LDX", "???", "CLV", "LDA", "TSX", "???", "LDY", "LDA", "LDX", "???",
+	"CPY", "CMP", "???", "???", "CPY", "CMP", "DEC", "???", "INY", "CMP", "DEX", "???", "CPY", "CMP", "DEC", "???",
+	"BNE", "CMP", "???", "???", "???", "CMP", "DEC", "???", "CLD", "CMP", "???", "???", "???", "CMP", "DEC", "???",
+	"CPX", "SBC", "???", "???", "CPX", "SBC", "INC", "???", "INX", "SBC", "NOP", "???", "CPX", "SBC", "INC", "???",
+	"BEQ", "SBC", "???", "???", "???", "SBC", "INC", "???", "SED", "SBC", "???", "???", "???", "SBC", "INC", "???"
+};
+
+// Addressing mode of each opcode
+const uint8_t OpcodeModes[256] =
+{
+	IMPLICIT, INDIRECTX, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, ACCUMULATOR, IMPLICIT, IMPLICIT, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, IMPLICIT,
+	ABSOLUTE, INDIRECTX, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, ACCUMULATOR, IMPLICIT, ABSOLUTE, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, IMPLICIT,
+	IMPLICIT, INDIRECTX, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, ACCUMULATOR, IMPLICIT, ABSOLUTE, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, IMPLICIT,
+	IMPLICIT, INDIRECTX, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, ACCUMULATOR, IMPLICIT, INDIRECT, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, IMPLICIT,
+	IMPLICIT, INDIRECTX, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTE, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, ZEROPAGEY, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, IMPLICIT, IMPLICIT,
+	IMMEDIATE, INDIRECTX, IMMEDIATE, IMPLICIT, ZEROPAGE, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, IMPLICIT, IMPLICIT, ABSOLUTE, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, ZEROPAGEY, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, ABSOLUTEY, IMPLICIT,
+	IMMEDIATE, INDIRECTX, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, IMPLICIT, IMPLICIT, ABSOLUTE, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, IMPLICIT,
+	IMMEDIATE, INDIRECTX, IMPLICIT, IMPLICIT, ZEROPAGE, ZEROPAGE, ZEROPAGE, IMPLICIT,
+	IMPLICIT, IMMEDIATE, IMPLICIT, IMPLICIT, ABSOLUTE, ABSOLUTE, ABSOLUTE, IMPLICIT,
+	RELATIVE, INDIRECTY, IMPLICIT, IMPLICIT, IMPLICIT, ZEROPAGEX, ZEROPAGEX, IMPLICIT,
+	IMPLICIT, ABSOLUTEY, IMPLICIT, IMPLICIT, IMPLICIT, ABSOLUTEX, ABSOLUTEX, IMPLICIT
+};
+
+// CPU variants
+// The core is compiled once per variant, each flag is a compile time constant so the
+// specialised dispatch carries no runtime checks. The 2A03 has no decimal mode, the NMOS
+// 6502 has BCD with flags taken from the binary result, the 65C02 fixes the flags, the
+// JMP ($xxFF) bug and adds its extra opcodes.
+struct Ricoh2A03
+{
+	static constexpr bool Decimal = false;
+	static constexpr bool CMOS = false;
+};
+
+struct NMOS6502
+{
+	static constexpr bool Decimal = true;
+	static constexpr bool CMOS = false;
+};
+
+struct WDC65C02
+{
+	static constexpr bool Decimal = true;
+	static constexpr bool CMOS = true;
+};
+
+// Opcodes the 65C02 adds over the NMOS part, the Rockwell bit instructions are not included
+struct CmosOpcode
+{
+	uint8_t opcode;
+	const char* name;
+	uint8_t mode;
+	uint8_t cycles;
+};
+
+const CmosOpcode CmosOpcodes[] =
+{
+	{ 0x04, "TSB", ZEROPAGE, 5 }, { 0x0C, "TSB", ABSOLUTE, 6 },
+	{ 0x14, "TRB", ZEROPAGE, 5 }, { 0x1C, "TRB", ABSOLUTE, 6 },
+	{ 0x12, "ORA", ZEROPAGEINDIRECT, 5 }, { 0x32, "AND", ZEROPAGEINDIRECT, 5 },
+	{ 0x52, "EOR", ZEROPAGEINDIRECT, 5 }, { 0x72, "ADC", ZEROPAGEINDIRECT, 5 },
+	{ 0x92, "STA", ZEROPAGEINDIRECT, 5 }, { 0xB2, "LDA", ZEROPAGEINDIRECT, 5 },
+	{ 0xD2, "CMP", ZEROPAGEINDIRECT, 5 }, { 0xF2, "SBC", ZEROPAGEINDIRECT, 5 },
+	{ 0x1A, "INC", ACCUMULATOR, 2 }, { 0x3A, "DEC", ACCUMULATOR, 2 },
+	{ 0x34, "BIT", ZEROPAGEX, 4 }, { 0x3C, "BIT", ABSOLUTEX, 4 }, { 0x89, "BIT", IMMEDIATE, 2 },
+	{ 0x5A, "PHY", IMPLICIT, 3 }, { 0x7A, "PLY", IMPLICIT, 4 },
+	{ 0xDA, "PHX", IMPLICIT, 3 }, { 0xFA, "PLX", IMPLICIT, 4 },
+	{ 0x64, "STZ", ZEROPAGE, 3 }, { 0x74, "STZ", ZEROPAGEX, 4 },
+	{ 0x9C, "STZ", ABSOLUTE, 4 }, { 0x9E, "STZ", ABSOLUTEX, 5 },
+	{ 0x80, "BRA", RELATIVE, 2 }, { 0x7C, "JMP", ABSOLUTEINDEXEDINDIRECT, 6 },
+	{ 0x6C, "JMP", INDIRECT, 6 }
+};
+
+const char* CmosOpcodeNames[256];
+uint8_t CmosOpcodeModes[256];
+uint8_t CmosOpcodeCycles[256];
+
+// Tables of the selected variant, used by decoding and the disassembler
+const char* const* opcodeNames = OpcodeNames;
+const uint8_t* opcodeModes = OpcodeModes;
+
+int InstructionLength(uint8_t opcode)
+{
+	return ModeLengths[opcodeModes[opcode]];
 }
 
-ofstream logfile;
 
-char logStatusBuffer[32];
-char logAXY[32];
+// Event scheduler
+// Subsystems post the CPU cycle at which they next need attention. The deadlines sit in a
+// binary min-heap, so the run loop compares the cycle counter against the earliest one and
+// executes instructions back to back until it is reached. There is no mapper IRQ source
+// yet, a scanline counter would post its deadline the same way.
+enum EventType
+{
+	EVENT_PPU, // Next scanline, a pending NMI or a finished frame
+	EVENT_FRAMECOUNTER, // APU frame sequencer step
+	EVENT_DMC, // DMC sample fetch
+	EVENT_IRQ, // IRQ line asserted, polled until it is taken or released
+	EVENT_COUNT
+};
+
+const uint64_t EventNever = UINT64_MAX;
+
+struct ScheduledEvent
+{
+	uint64_t cycle;
+	uint8_t type;
+};
+
+ScheduledEvent eventHeap[EVENT_COUNT];
+uint8_t eventSlots[EVENT_COUNT]; // Heap position of each event type
+uint64_t nextEventCycle; // Deadline at the top of the heap
+
+void SwapEvents(int a, int b)
+{
+	std::swap(eventHeap[a], eventHeap[b]);
+	eventSlots[eventHeap[a].type] = a;
+	eventSlots[eventHeap[b].type] = b;
+}
 
-void LogInstruction()
+// Sets an event's deadline and moves it up or down to its place in the heap
+void ScheduleEvent(uint8_t type, uint64_t cycle)
 {
-	static char temp1[32];
-	static char logBuffer[128];
+	int index = eventSlots[type];
+	eventHeap[index].cycle = cycle;
 
-	switch (addressingMode)
+	while (index > 0 && eventHeap[(index - 1) / 2].cycle > cycle)
 	{
-		case IMPLICIT:
-			sprintf(temp1, "");
-			break;
-		case ACCUMULATOR:
-			sprintf(temp1, "A");
-			break;
-		case IMMEDIATE:
-			sprintf(temp1, "#$%02x", operands[0]);
-			break;
-		case ZEROPAGE:
-			sprintf(temp1, "$%02x", operands[0]);
-			break;
-		case ZEROPAGEX:
-			sprintf(temp1, "$%02x,X", operands[0]);
-			break;
-		case ZEROPAGEY:
-			sprintf(temp1, "$%02x,Y", operands[0]);
-			break;
-		case RELATIVE:
-			sprintf(temp1, "*%d", static_cast<int8_t>(operands[0]));
-			break;
-		case ABSOLUTE:
-			sprintf(temp1, "$%02x $%02x", operands[0], operands[1]);
-			break;
-		case ABSOLUTEX:
-			sprintf(temp1, "$%02x $%02x,X", operands[0], operands[1]);
-			break;
-		case ABSOLUTEY:
-			sprintf(temp1, "$%02x $%02x,Y", operands[0], operands[1]);
-			break;
-		case INDIRECT:
-			sprintf(temp1, "($%02x $%02x)", operands[0], operands[1]);
-			break;
-		case INDIRECTX:
-			sprintf(temp1, "($%02x,X)", operands[0]);
-			break;
-		case INDIRECTY:
-			sprintf(temp1, "($%02x),Y", operands[0]);
-			break;
-		default:
+		SwapEvents(index, (index - 1) / 2);
+		index = (index - 1) / 2;
+	}
+
+	for (;;)
+	{
+		int smallest = index;
+		int left = index * 2 + 1;
+		int right = left + 1;
+
+		if (left < EVENT_COUNT && eventHeap[left].cycle < eventHeap[smallest].cycle)
+			smallest = left;
+		if (right < EVENT_COUNT && eventHeap[right].cycle < eventHeap[smallest].cycle)
+			smallest = right;
+
+		if (smallest == index)
 			break;
+
+		SwapEvents(index, smallest);
+		index = smallest;
 	}
-	
-	//sprintf(logStatusBuffer, "%c%c%c%c%c%c%c%c", N ? 'N' : 'n', V ? 'V' : 'v', 'U', 'B', D ? 'D' : 'd', I ? 'I' : 'i', Z ? 'Z' : 'z', C ? 'C' : 'c');
 
-	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (V << 6) | (N << 7);
-	sprintf(logBuffer, "%04x %s %s %s P: %s\n", logAddress, szInstruction, temp1, logAXY, logStatusBuffer);
+	nextEventCycle = eventHeap[0].cycle;
+}
 
-	if (logfile)
-		logfile << logBuffer;
-	else
-		printf(logBuffer);
+uint64_t EventCycle(uint8_t type)
+{
+	return eventHeap[eventSlots[type]].cycle;
 }
 
-uint8_t ReadMemory(uint16_t address)
+void ResetEvents()
 {
-    // 2k internal ram (valid range 0x0 to 0x07FF)
-    // Values over 0x07FF wrap back to 0 (are mirrored)
-    if (address >= 0 && address < 0x2000)
-    {
-        return RAM[address & 0x7FF];
-    }
-	else if (address >= 0x2000 && address < 0x4000)
+	for (int i = 0; i < EVENT_COUNT; ++i)
 	{
-		// Mirror 0x2000 to 0x2007
-		uint8_t value = PPU[address & 0x0007];
+		eventHeap[i].cycle = EventNever;
+		eventHeap[i].type = i;
+		eventSlots[i] = i;
+	}
 
-		// Rest last bit
-		if ((0x2000 + (address & 0x0007)) == 0x2002)
-		{
-			PPU[address & 0x0007] = value & 0x7F;
-		}
+	nextEventCycle = EventNever;
+}
 
-		return value;
-	}
-	else if (address >= 0x6000 && address <= 0x7FFF)
-	{
-		return SaveWorkRAM[address - 0x6000];
-	}
-	else if (address >= 0x8000 && address <= 0xFFFF)
+
+// APU
+
+const uint32_t CpuClockRate = 1789773;
+
+uint8_t ReadMemory(uint16_t address);
+
+// Band-limited step synthesis. Channel output changes are added to the buffer
+// as deltas at their CPU cycle timestamp, convolved with a windowed sinc kernel
+// chosen by the sub-sample phase, and integrated when samples are read out.
+const int BlipSampleRate = 44100;
+const int BlipPhaseBits = 5;
+const int BlipPhaseCount = 1 << BlipPhaseBits;
+const int BlipKernelWidth = 16;
+const int BlipKernelBits = 14;
+const int BlipBufferSize = 4096;
+
+int32_t blipKernel[BlipPhaseCount][BlipKernelWidth];
+int32_t blipBuffer[BlipBufferSize + BlipKernelWidth];
+uint64_t blipFactor; // Output samples per CPU cycle (32.32 fixed point)
+uint64_t blipOffset; // Buffer position of blipFrameStart (32.32 fixed point)
+uint64_t blipFrameStart; // CPU cycle the buffer timebase starts at
+int32_t blipIntegrator;
+
+void InitBlip()
+{
+	const double pi = 3.14159265358979323846;
+	const double cutoff = 0.45;
+
+	blipFactor = static_cast<uint64_t>(static_cast<double>(BlipSampleRate) / CpuClockRate * 4294967296.0 + 0.5);
+
+	for (int phase = 0; phase < BlipPhaseCount; ++phase)
 	{
-		if (address >= 0xC000)
+		double taps[BlipKernelWidth];
+		double sum = 0;
+
+		for (int k = 0; k < BlipKernelWidth; ++k)
 		{
-			return ROM[address - 0xC000];
+			double x = k - BlipKernelWidth / 2 - static_cast<double>(phase) / BlipPhaseCount;
+			double sinc = x == 0 ? 1.0 : sin(2 * pi * cutoff * x) / (2 * pi * cutoff * x);
+			double window = 0.42 + 0.5 * cos(2 * pi * x / BlipKernelWidth) + 0.08 * cos(4 * pi * x / BlipKernelWidth);
+
+			taps[k] = sinc * window;
+			sum += taps[k];
 		}
-		else
+
+		// Normalize so every phase sums to exactly one unit, otherwise steps leave a DC error
+		int32_t total = 0;
+		for (int k = 0; k < BlipKernelWidth; ++k)
 		{
-			return ROM[address - 0x8000];
+			blipKernel[phase][k] = static_cast<int32_t>(floor(taps[k] / sum * (1 << BlipKernelBits) + 0.5));
+			total += blipKernel[phase][k];
 		}
+
+		blipKernel[phase][BlipKernelWidth / 2] += (1 << BlipKernelBits) - total;
 	}
-    
-    return 0;
 }
 
-void WriteMemory(uint16_t address, uint8_t value)
+void ClearBlip(uint64_t time)
 {
-    if (address >= 0 && address < 0x2000)
-    {
-        RAM[address & 0x07FF] = value;
-    }
-	else if (address >= 0x2000 && address < 0x4000)
-	{
-		// Mirror 0x2000 to 0x2007
-		PPU[address & 0x0007] = value;
-	}
-	else if (address >= 0x6000 && address <= 0x7FFF)
-	{
-		SaveWorkRAM[address - 0x6000] = value;
-	}
-	else if (address >= 0x8000 && address <= 0xFFFF)
-	{
-		ROM[address - 0x8000] = value;
-	}
-	else
+	memset(blipBuffer, 0, sizeof(blipBuffer));
+	blipOffset = 0;
+	blipFrameStart = time;
+	blipIntegrator = 0;
+}
+
+void BlipAddDelta(uint64_t time, int delta)
+{
+	uint64_t position = blipOffset + (time - blipFrameStart) * blipFactor;
+	uint32_t index = static_cast<uint32_t>(position >> 32);
+	int phase = static_cast<int>(position >> (32 - BlipPhaseBits)) & (BlipPhaseCount - 1);
+
+	// Too many cycles without reading samples, drop rather than overrun
+	if (index >= BlipBufferSize)
+		return;
+
+	int32_t* out = blipBuffer + index;
+	const int32_t* kernel = blipKernel[phase];
+
+	for (int k = 0; k < BlipKernelWidth; ++k)
 	{
-		int a = 0;
+		out[k] += kernel[k] * delta;
 	}
 }
 
-uint8_t PullStack()
+void BlipEndFrame(uint64_t time)
 {
-	++SP;
-	return ReadMemory(0x100 + SP);
+	blipOffset += (time - blipFrameStart) * blipFactor;
+	blipFrameStart = time;
 }
 
-void PushStack(uint8_t value)
+int BlipSamplesAvailable()
 {
-	WriteMemory(0x100 + SP, value);
-	--SP;
+	int available = static_cast<int>(blipOffset >> 32);
+	return available < BlipBufferSize ? available : BlipBufferSize;
 }
 
-// Addressing Modes
-
-void Implicit()
+int BlipReadSamples(int16_t* out, int count)
 {
-	addressingMode = IMPLICIT;
+	int available = BlipSamplesAvailable();
+	if (count > available)
+		count = available;
+
+	for (int i = 0; i < count; ++i)
+	{
+		blipIntegrator += blipBuffer[i];
+
+		int sample = blipIntegrator >> BlipKernelBits;
+		if (sample > 32767)
+			sample = 32767;
+		else if (sample < -32768)
+			sample = -32768;
+
+		out[i] = static_cast<int16_t>(sample);
+
+		// Leak the integrator so the output is centred on zero (DC removal)
+		blipIntegrator -= blipIntegrator >> 9;
+	}
+
+	int remaining = BlipBufferSize + BlipKernelWidth - count;
+	memmove(blipBuffer, blipBuffer + count, remaining * sizeof(blipBuffer[0]));
+	memset(blipBuffer + remaining, 0, count * sizeof(blipBuffer[0]));
+	blipOffset -= static_cast<uint64_t>(count) << 32;
+
+	return count;
 }
 
-uint8_t Accumulator()
+// Channel weights use the linear approximation of the NES mixer so each
+// channel can be synthesized independently (scaled so 1.0 is ~30000).
+const int PulseWeight = 226;
+const int TriangleWeight = 255;
+const int NoiseWeight = 148;
+const int DmcWeight = 100;
+
+const uint8_t LengthTable[32] =
 {
-	addressingMode = ACCUMULATOR;
+	10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+	12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
 
-    return A;
-}
+const uint8_t DutyTable[4][8] =
+{
+	{ 0, 1, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 1, 0, 0, 0, 0, 0 },
+	{ 0, 1, 1, 1, 1, 0, 0, 0 },
+	{ 1, 0, 0, 1, 1, 1, 1, 1 }
+};
 
-uint8_t Immediate()
+const uint8_t TriangleSequence[32] =
 {
-	addressingMode = IMMEDIATE;
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15
+};
 
-    uint8_t value = ReadMemory(PC++);
+const uint16_t NoisePeriods[16] = { 4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068 };
+const uint16_t DmcRates[16] = { 428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54 };
 
-	operands[0] = value;
+struct Envelope
+{
+	uint8_t start;
+	uint8_t loop;
+	uint8_t constant;
+	uint8_t volume;
+	uint8_t divider;
+	uint8_t decay;
+};
 
-	return value;
-}
+struct PulseChannel
+{
+	Envelope envelope;
+	uint8_t duty;
+	uint8_t dutyPhase;
+	uint8_t sweepEnabled;
+	uint8_t sweepPeriod;
+	uint8_t sweepNegate;
+	uint8_t sweepShift;
+	uint8_t sweepDivider;
+	uint8_t sweepReload;
+	uint8_t lengthCounter;
+	uint8_t enabled;
+	uint8_t onesComplement; // Pulse 1 negates with one's complement
+	uint16_t timer;
+	uint64_t next; // Cycle of the next sequencer step
+	int amplitude;
+};
 
-uint16_t ZeroPageAddress()
+struct TriangleChannel
+{
+	uint8_t control;
+	uint8_t linearReload;
+	uint8_t linearCounter;
+	uint8_t linearReloadFlag;
+	uint8_t lengthCounter;
+	uint8_t enabled;
+	uint8_t phase;
+	uint16_t timer;
+	uint64_t next;
+	int amplitude;
+};
+
+struct NoiseChannel
+{
+	Envelope envelope;
+	uint8_t mode;
+	uint8_t lengthCounter;
+	uint8_t enabled;
+	uint16_t period;
+	uint16_t shift;
+	uint64_t next;
+	int amplitude;
+};
+
+struct DmcChannel
 {
-	addressingMode = ZEROPAGE;
+	uint8_t irqEnabled;
+	uint8_t loop;
+	uint8_t level;
+	uint8_t buffer;
+	uint8_t bufferEmpty;
+	uint8_t shift;
+	uint8_t bitsRemaining;
+	uint8_t silence;
+	uint16_t rate;
+	uint16_t sampleAddress;
+	uint16_t sampleLength;
+	uint16_t address;
+	uint16_t bytesRemaining;
+	uint64_t next;
+	int amplitude;
+};
 
-    uint8_t address = ReadMemory(PC++);
+PulseChannel pulse1, pulse2;
+TriangleChannel triangle;
+NoiseChannel noise;
+DmcChannel dmc;
 
-	operands[0] = address;
+uint8_t frameCounterMode; // 0 = 4 step, 1 = 5 step
+uint8_t frameIrqInhibit;
+uint8_t frameIrq;
+uint8_t dmcIrq;
+uint8_t frameSequencerStep;
+uint64_t frameSequencerNext;
 
-	return address;
-}
+uint64_t apuTime; // Cycle the APU has been run up to
+uint8_t apuIrq;
 
-uint8_t ZeroPage()
+// Frame sequencer step timings in CPU cycles after $4017 was written
+const uint16_t FrameSequencerTimes[2][5] =
 {
-    return ReadMemory(ZeroPageAddress());
-}
+	{ 7457, 14913, 22371, 29829, 29830 },
+	{ 7457, 14913, 22371, 29829, 37282 }
+};
 
-uint16_t ZeroPageXAddress()
+ofstream wavfile;
+uint32_t wavSampleCount;
+int16_t audioSamples[BlipBufferSize];
+
+void SetAmplitude(int& amplitude, int value, int weight, uint64_t time)
 {
-	addressingMode = ZEROPAGEX;
+	if (value != amplitude)
+	{
+		BlipAddDelta(time, (value - amplitude) * weight);
+		amplitude = value;
+	}
+}
 
-    uint8_t address = ReadMemory(PC++);
+// Advance a timer that produces no output change, returns the number of clocks skipped
+uint64_t SkipTimer(uint64_t& next, uint32_t period, uint64_t end)
+{
+	if (next >= end)
+		return 0;
 
-	operands[0] = address;
+	uint64_t steps = (end - next + period - 1) / period;
+	next += steps * period;
 
-    return ((address + X) % 256);
+	return steps;
 }
 
-uint8_t ZeroPageX()
+uint8_t EnvelopeVolume(const Envelope& envelope)
 {
-    return ReadMemory(ZeroPageXAddress());
+	return envelope.constant ? envelope.volume : envelope.decay;
 }
 
-uint16_t ZeroPageYAddress()
+void ClockEnvelope(Envelope& envelope)
 {
-	addressingMode = ZEROPAGEY;
+	if (envelope.start)
+	{
+		envelope.start = 0;
+		envelope.decay = 15;
+		envelope.divider = envelope.volume;
+	}
+	else if (envelope.divider == 0)
+	{
+		envelope.divider = envelope.volume;
+
+		if (envelope.decay > 0)
+			--envelope.decay;
+		else if (envelope.loop)
+			envelope.decay = 15;
+	}
+	else
+	{
+		--envelope.divider;
+	}
+}
 
-	uint8_t address = ReadMemory(PC++);
+uint16_t SweepTarget(const PulseChannel& pulse)
+{
+	uint16_t change = pulse.timer >> pulse.sweepShift;
 
-	operands[0] = address;
+	if (pulse.sweepNegate)
+		return pulse.timer - change - pulse.onesComplement;
 
-	return ((address + Y) % 256);
+	return pulse.timer + change;
 }
 
-uint8_t ZeroPageY()
+bool PulseMuted(const PulseChannel& pulse)
 {
-	return ReadMemory(ZeroPageYAddress());
+	return pulse.timer < 8 || (!pulse.sweepNegate && SweepTarget(pulse) > 0x7FF);
 }
 
-uint8_t Relative()
+void ClockSweep(PulseChannel& pulse)
 {
-	addressingMode = RELATIVE;
-
-	uint8_t offset = ReadMemory(PC++);
-
-	operands[0] = offset;
+	if (pulse.sweepDivider == 0 && pulse.sweepEnabled && pulse.sweepShift > 0 && !PulseMuted(pulse))
+	{
+		pulse.timer = SweepTarget(pulse);
+	}
 
-	return offset;
+	if (pulse.sweepDivider == 0 || pulse.sweepReload)
+	{
+		pulse.sweepDivider = pulse.sweepPeriod;
+		pulse.sweepReload = 0;
+	}
+	else
+	{
+		--pulse.sweepDivider;
+	}
 }
 
-uint16_t AbsoluteAddress()
+void RunPulse(PulseChannel& pulse, uint64_t end)
 {
-	addressingMode = ABSOLUTE;
+	uint32_t period = (pulse.timer + 1) * 2;
+	int volume = 0;
 
-    uint8_t low = ReadMemory(PC++);
-    uint8_t high = ReadMemory(PC++);
+	if (pulse.lengthCounter > 0 && !PulseMuted(pulse))
+		volume = EnvelopeVolume(pulse.envelope);
 
-	operands[0] = low;
-	operands[1] = high;
+	// Pick up register and frame sequencer changes made since the last run
+	SetAmplitude(pulse.amplitude, DutyTable[pulse.duty][pulse.dutyPhase] * volume, PulseWeight, apuTime);
 
-    return (low | (high << 8));
+	if (volume == 0)
+	{
+		pulse.dutyPhase = (pulse.dutyPhase + SkipTimer(pulse.next, period, end)) & 7;
+		return;
+	}
+
+	while (pulse.next < end)
+	{
+		pulse.dutyPhase = (pulse.dutyPhase + 1) & 7;
+		SetAmplitude(pulse.amplitude, DutyTable[pulse.duty][pulse.dutyPhase] * volume, PulseWeight, pulse.next);
+		pulse.next += period;
+	}
 }
 
-uint8_t Absolute()
+void RunTriangle(uint64_t end)
 {
-    return ReadMemory(AbsoluteAddress());
+	uint32_t period = triangle.timer + 1;
+
+	// Ultrasonic periods are skipped as they only produce a pop
+	if (triangle.lengthCounter == 0 || triangle.linearCounter == 0 || triangle.timer < 2)
+	{
+		SkipTimer(triangle.next, period, end);
+		return;
+	}
+
+	while (triangle.next < end)
+	{
+		triangle.phase = (triangle.phase + 1) & 31;
+		SetAmplitude(triangle.amplitude, TriangleSequence[triangle.phase], TriangleWeight, triangle.next);
+		triangle.next += period;
+	}
 }
 
-uint16_t AbsoluteXAddress()
+void RunNoise(uint64_t end)
 {
-	addressingMode = ABSOLUTEX;
+	int volume = noise.lengthCounter > 0 ? EnvelopeVolume(noise.envelope) : 0;
+	int tap = noise.mode ? 6 : 1;
+
+	SetAmplitude(noise.amplitude, (noise.shift & 1) ? 0 : volume, NoiseWeight, apuTime);
 
-    uint8_t low = ReadMemory(PC++);
-    uint8_t high = ReadMemory(PC++);
-    uint16_t address = low | (high << 8);
+	while (noise.next < end)
+	{
+		uint16_t feedback = (noise.shift ^ (noise.shift >> tap)) & 1;
+		noise.shift = (noise.shift >> 1) | (feedback << 14);
 
-	operands[0] = low;
-	operands[1] = high;
+		if (volume)
+			SetAmplitude(noise.amplitude, (noise.shift & 1) ? 0 : volume, NoiseWeight, noise.next);
 
-    return address + X;
+		noise.next += noise.period;
+	}
 }
 
-uint8_t AbsoluteX()
+void FetchDmcSample()
 {
-    return ReadMemory(AbsoluteXAddress());
+	// The DMC DMA halts the CPU while it reads the sample byte
+	cycles += 4;
+
+	dmc.buffer = ReadMemory(dmc.address);
+	dmc.bufferEmpty = 0;
+	dmc.address = dmc.address == 0xFFFF ? 0x8000 : dmc.address + 1;
+
+	if (--dmc.bytesRemaining == 0)
+	{
+		if (dmc.loop)
+		{
+			dmc.address = dmc.sampleAddress;
+			dmc.bytesRemaining = dmc.sampleLength;
+		}
+		else if (dmc.irqEnabled)
+		{
+			dmcIrq = 1;
+		}
+	}
 }
 
-uint16_t AbsoluteYAddress()
+void RunDmc(uint64_t end)
 {
-	addressingMode = ABSOLUTEY;
+	SetAmplitude(dmc.amplitude, dmc.level, DmcWeight, apuTime);
+
+	while (dmc.next < end)
+	{
+		if (!dmc.silence)
+		{
+			if (dmc.shift & 1)
+			{
+				if (dmc.level <= 125)
+					dmc.level += 2;
+			}
+			else if (dmc.level >= 2)
+			{
+				dmc.level -= 2;
+			}
+
+			SetAmplitude(dmc.amplitude, dmc.level, DmcWeight, dmc.next);
+		}
 
-    uint8_t low = ReadMemory(PC++);
-    uint8_t high = ReadMemory(PC++);
-    uint16_t address = low | (high << 8);
+		dmc.shift >>= 1;
 
-	operands[0] = low;
-	operands[1] = high;
+		if (--dmc.bitsRemaining == 0)
+		{
+			dmc.bitsRemaining = 8;
+			dmc.silence = dmc.bufferEmpty;
+			dmc.shift = dmc.buffer;
+			dmc.bufferEmpty = 1;
+
+			if (dmc.bytesRemaining > 0)
+				FetchDmcSample();
+		}
 
-    return address + Y;
+		dmc.next += dmc.rate;
+	}
 }
 
-uint8_t AbsoluteY()
+void ClockQuarterFrame()
 {
-	return ReadMemory(AbsoluteYAddress());
+	ClockEnvelope(pulse1.envelope);
+	ClockEnvelope(pulse2.envelope);
+	ClockEnvelope(noise.envelope);
+
+	if (triangle.linearReloadFlag)
+		triangle.linearCounter = triangle.linearReload;
+	else if (triangle.linearCounter > 0)
+		--triangle.linearCounter;
+
+	if (!triangle.control)
+		triangle.linearReloadFlag = 0;
 }
 
-uint16_t IndirectAddress()
+void ClockHalfFrame()
 {
-	addressingMode = INDIRECT;
-
-    uint8_t low = ReadMemory(PC++);
-    uint8_t high = ReadMemory(PC++);
+	// The envelope loop flag doubles as the length counter halt flag
+	if (pulse1.lengthCounter > 0 && !pulse1.envelope.loop)
+		--pulse1.lengthCounter;
+	if (pulse2.lengthCounter > 0 && !pulse2.envelope.loop)
+		--pulse2.lengthCounter;
+	if (triangle.lengthCounter > 0 && !triangle.control)
+		--triangle.lengthCounter;
+	if (noise.lengthCounter > 0 && !noise.envelope.loop)
+		--noise.lengthCounter;
+
+	ClockSweep(pulse1);
+	ClockSweep(pulse2);
+}
 
-	operands[0] = low;
-	operands[1] = high;
+void ClockFrameSequencer()
+{
+	uint8_t step = frameSequencerStep;
+	uint64_t start = frameSequencerNext - FrameSequencerTimes[frameCounterMode][step];
 
-	uint16_t address = (low | (high << 8));
-    low = ReadMemory(address);
+	if (frameCounterMode == 0)
+	{
+		if (step != 4)
+			ClockQuarterFrame();
+		if (step == 1 || step == 3)
+			ClockHalfFrame();
+		if (step >= 3 && !frameIrqInhibit)
+			frameIrq = 1;
+	}
+	else
+	{
+		if (step != 3)
+			ClockQuarterFrame();
+		if (step == 1 || step == 4)
+			ClockHalfFrame();
+	}
 
-	// If the address is on a page boundary 0x??FF then it changes to 0x??00 for the high byte
-	// Example 0x02FF becomes 0x0200
-	if ((address & 0xFF) == 0xFF)
+	if (step == 4)
 	{
-		high = ReadMemory(address & 0xFF00);
+		start = frameSequencerNext;
+		step = 0;
 	}
 	else
 	{
-		high = ReadMemory(address + 1);
+		++step;
 	}
 
-    return (low | (high << 8));
+	frameSequencerStep = step;
+	frameSequencerNext = start + FrameSequencerTimes[frameCounterMode][step];
 }
 
-uint16_t IndirectXAddress()
+// The CPU hands control back to the APU at the next frame sequencer step or
+// DMC sample fetch, so interrupts and DMA stalls land close to their real time
+void UpdateApuEvent()
 {
-	addressingMode = INDIRECTX;
-
-	uint8_t temp = ReadMemory(PC++);
-	uint8_t low = ReadMemory((temp + X) % 256);
-	uint8_t high = ReadMemory((temp + 1 + X) % 256);
+	ScheduleEvent(EVENT_FRAMECOUNTER, frameSequencerNext);
 
-	operands[0] = temp;
+	if (dmc.bytesRemaining > 0)
+		ScheduleEvent(EVENT_DMC, dmc.next + (dmc.bitsRemaining - 1) * dmc.rate);
+	else
+		ScheduleEvent(EVENT_DMC, EventNever);
 
-	return low | (high << 8);
+	// An asserted line is polled after every instruction until the CPU takes it
+	if (apuIrq)
+		ScheduleEvent(EVENT_IRQ, cycles);
 }
 
-uint8_t IndirectX()
+// Catch the APU up to the given CPU cycle. Channels are advanced from one timer
+// event to the next, so the cost depends on how often outputs change rather
+// than on the number of CPU cycles elapsed.
+void RunAPU(uint64_t end)
 {
-    return ReadMemory(IndirectXAddress());
-}
+	while (apuTime < end)
+	{
+		uint64_t stop = end < frameSequencerNext ? end : frameSequencerNext;
 
-uint16_t IndirectYAddress()
-{
-	addressingMode = INDIRECTY;
+		RunPulse(pulse1, stop);
+		RunPulse(pulse2, stop);
+		RunTriangle(stop);
+		RunNoise(stop);
+		RunDmc(stop);
 
-	uint8_t temp = ReadMemory(PC++);
-	uint8_t low = ReadMemory(temp);
-	uint8_t high = ReadMemory((temp + 1) % 256);
+		apuTime = stop;
 
-	operands[0] = temp;
+		if (stop == frameSequencerNext)
+			ClockFrameSequencer();
+	}
 
-	return (low | (high << 8)) + Y;
+	apuIrq = frameIrq | dmcIrq;
+	UpdateApuEvent();
 }
 
-uint8_t IndirectY()
-{  
-    return ReadMemory(IndirectYAddress());
+void WritePulse(PulseChannel& pulse, uint16_t reg, uint8_t value)
+{
+	switch (reg)
+	{
+		case 0:
+			pulse.duty = value >> 6;
+			pulse.envelope.loop = (value >> 5) & 0x01;
+			pulse.envelope.constant = (value >> 4) & 0x01;
+			pulse.envelope.volume = value & 0x0F;
+			break;
+		case 1:
+			pulse.sweepEnabled = value >> 7;
+			pulse.sweepPeriod = (value >> 4) & 0x07;
+			pulse.sweepNegate = (value >> 3) & 0x01;
+			pulse.sweepShift = value & 0x07;
+			pulse.sweepReload = 1;
+			break;
+		case 2:
+			pulse.timer = (pulse.timer & 0x700) | value;
+			break;
+		case 3:
+			pulse.timer = (pulse.timer & 0xFF) | ((value & 0x07) << 8);
+			if (pulse.enabled)
+				pulse.lengthCounter = LengthTable[value >> 3];
+			pulse.dutyPhase = 0;
+			pulse.envelope.start = 1;
+			break;
+	}
 }
 
-// ADC (Add with carry)
-void ADC(uint8_t value)
+void RestartDmcSample()
 {
-    uint16_t result = A + value + C;
-    
-    // Carry flag
-    C = (result & 0x100) >> 8;
-    
-    // Overflow flag
-    V = (((A ^ result) & (value ^ result) & 0x80) >> 7) & 0x01;
-    
-    A = result & 0xFF;
+	dmc.address = dmc.sampleAddress;
+	dmc.bytesRemaining = dmc.sampleLength;
+}
 
-	// Zero flag
-	Z = A == 0 ? 1 : 0;
+// Register writes are timestamped by catching the APU up to the current cycle first
+void WriteAPU(uint16_t address, uint8_t value)
+{
+	RunAPU(cycles);
 
-	// Negative flag
-	N = (A >> 7) & 0x1;
+	switch (address)
+	{
+		case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+			WritePulse(pulse1, address & 0x03, value);
+			break;
+		case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+			WritePulse(pulse2, address & 0x03, value);
+			break;
+		case 0x4008:
+			triangle.control = value >> 7;
+			triangle.linearReload = value & 0x7F;
+			break;
+		case 0x400A:
+			triangle.timer = (triangle.timer & 0x700) | value;
+			break;
+		case 0x400B:
+			triangle.timer = (triangle.timer & 0xFF) | ((value & 0x07) << 8);
+			if (triangle.enabled)
+				triangle.lengthCounter = LengthTable[value >> 3];
+			triangle.linearReloadFlag = 1;
+			break;
+		case 0x400C:
+			noise.envelope.loop = (value >> 5) & 0x01;
+			noise.envelope.constant = (value >> 4) & 0x01;
+			noise.envelope.volume = value & 0x0F;
+			break;
+		case 0x400E:
+			noise.mode = value >> 7;
+			noise.period = NoisePeriods[value & 0x0F];
+			break;
+		case 0x400F:
+			if (noise.enabled)
+				noise.lengthCounter = LengthTable[value >> 3];
+			noise.envelope.start = 1;
+			break;
+		case 0x4010:
+			dmc.irqEnabled = value >> 7;
+			dmc.loop = (value >> 6) & 0x01;
+			dmc.rate = DmcRates[value & 0x0F];
+			if (!dmc.irqEnabled)
+				dmcIrq = 0;
+			break;
+		case 0x4011:
+			dmc.level = value & 0x7F;
+			break;
+		case 0x4012:
+			dmc.sampleAddress = 0xC000 + (value << 6);
+			break;
+		case 0x4013:
+			dmc.sampleLength = (value << 4) + 1;
+			break;
+		case 0x4015:
+			pulse1.enabled = value & 0x01;
+			pulse2.enabled = (value >> 1) & 0x01;
+			triangle.enabled = (value >> 2) & 0x01;
+			noise.enabled = (value >> 3) & 0x01;
+
+			if (!pulse1.enabled)
+				pulse1.lengthCounter = 0;
+			if (!pulse2.enabled)
+				pulse2.lengthCounter = 0;
+			if (!triangle.enabled)
+				triangle.lengthCounter = 0;
+			if (!noise.enabled)
+				noise.lengthCounter = 0;
+
+			dmcIrq = 0;
+
+			if (!(value & 0x10))
+			{
+				dmc.bytesRemaining = 0;
+			}
+			else if (dmc.bytesRemaining == 0)
+			{
+				RestartDmcSample();
+
+				if (dmc.bufferEmpty)
+					FetchDmcSample();
+			}
+			break;
+		case 0x4017:
+			frameCounterMode = value >> 7;
+			frameIrqInhibit = (value >> 6) & 0x01;
+
+			if (frameIrqInhibit)
+				frameIrq = 0;
+
+			// 5 step mode clocks the quarter and half frame units immediately
+			if (frameCounterMode)
+			{
+				ClockQuarterFrame();
+				ClockHalfFrame();
+			}
+
+			frameSequencerStep = 0;
+			frameSequencerNext = cycles + FrameSequencerTimes[frameCounterMode][0];
+			break;
+		default:
+			break;
+	}
 
-	SetInstruction("ADC");
+	apuIrq = frameIrq | dmcIrq;
+	UpdateApuEvent();
 }
 
-// AND (Logical AND)
-void AND(uint8_t value)
+uint8_t ReadAPUStatus()
 {
-    A &= value;
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (A >> 7) & 0x1;
+	RunAPU(cycles);
 
-	SetInstruction("AND");
+	uint8_t status = (pulse1.lengthCounter > 0) |
+		((pulse2.lengthCounter > 0) << 1) |
+		((triangle.lengthCounter > 0) << 2) |
+		((noise.lengthCounter > 0) << 3) |
+		((dmc.bytesRemaining > 0) << 4) |
+		(frameIrq << 6) |
+		(dmcIrq << 7);
+
+	// Reading the status clears the frame interrupt
+	frameIrq = 0;
+	apuIrq = dmcIrq;
+
+	return status;
 }
 
-// Arithmetic Shift Left
-void ASL_A()
+void ResetAPU()
 {
-	// Carry flag
-	C = ((A & 0x80) >> 7) & 0x01;
+	memset(&pulse1, 0, sizeof(pulse1));
+	memset(&pulse2, 0, sizeof(pulse2));
+	memset(&triangle, 0, sizeof(triangle));
+	memset(&noise, 0, sizeof(noise));
+	memset(&dmc, 0, sizeof(dmc));
+
+	pulse1.onesComplement = 1;
+	noise.shift = 1;
+	noise.period = NoisePeriods[0];
+	dmc.rate = DmcRates[0];
+	dmc.bufferEmpty = 1;
+	dmc.silence = 1;
+	dmc.bitsRemaining = 8;
+
+	frameCounterMode = 0;
+	frameIrqInhibit = 0;
+	frameIrq = 0;
+	dmcIrq = 0;
+	apuIrq = 0;
+	frameSequencerStep = 0;
+	frameSequencerNext = cycles + FrameSequencerTimes[0][0];
+
+	apuTime = cycles;
+	UpdateApuEvent();
+
+	InitBlip();
+	ClearBlip(cycles);
+}
 
-	A = A << 1;
+void OpenWav(const char* filename)
+{
+	wavfile.open(filename, std::ios::binary | std::ios::trunc);
+	wavSampleCount = 0;
+
+	// Header sizes are filled in by CloseWav
+	char header[44] = { 'R', 'I', 'F', 'F', 0, 0, 0, 0, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ', 16, 0, 0, 0, 1, 0, 1, 0 };
+	uint32_t rate = BlipSampleRate;
+	uint32_t byteRate = BlipSampleRate * 2;
+	memcpy(header + 24, &rate, 4);
+	memcpy(header + 28, &byteRate, 4);
+	header[32] = 2;
+	header[34] = 16;
+	memcpy(header + 36, "data", 4);
+
+	wavfile.write(header, sizeof(header));
+}
 
-	// Zero flag
-	Z = A == 0 ? 1 : 0;
+void CloseWav()
+{
+	if (!wavfile)
+		return;
 
-	// Negative flag
-	N = (A >> 7) & 0x1;
+	uint32_t dataSize = wavSampleCount * 2;
+	uint32_t riffSize = dataSize + 36;
 
-	SetInstruction("ASL");
+	wavfile.seekp(4, std::ios::beg);
+	wavfile.write((char*)&riffSize, 4);
+	wavfile.seekp(40, std::ios::beg);
+	wavfile.write((char*)&dataSize, 4);
+	wavfile.close();
 }
 
-void ASL(uint16_t address)
+// Called once per frame, synthesizes every sample for the frame in one batch
+int EndAudioFrame()
 {
-	uint8_t value = ReadMemory(address);
+	RunAPU(cycles);
+	BlipEndFrame(cycles);
 
-	// Carry flag
-	C = ((value & 0x80) >> 7) & 0x01;
+	int count = BlipReadSamples(audioSamples, BlipBufferSize);
 
-    value = value << 1;
-    
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
+	if (wavfile.is_open())
+	{
+		wavfile.write((char*)audioSamples, count * sizeof(audioSamples[0]));
+		wavSampleCount += count;
+	}
 
-	WriteMemory(address, value);
-    
-	SetInstruction("ASL");
+	return count;
 }
 
-// Branch if Carry Clear
-void BCC(uint8_t value)
-{
-    if (!C)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+// Frame output
+// Finished frames are handed to a list of sinks without being copied. The PPU
+// renders into a small pool of frame buffers and each buffer is reference
+// counted: sinks that work on a background thread hold a reference until they
+// are done with it, and the PPU only renders into buffers nobody references.
 
-	SetInstruction("BCC");
-}
+const int ScreenWidth = 256;
+const int ScreenHeight = 240;
+const int FrameBufferCount = 4;
 
-// Branch if Carry Set
-void BCS(uint8_t value)
+// Pixels are 6-bit palette colors with grayscale already applied, a quarter the size of
+// RGBA. Emphasis can only change between lines here, so it's kept once per line.
+struct FrameBuffer
 {
-    if (C)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+	uint8_t pixels[ScreenWidth * ScreenHeight];
+	uint8_t emphasis[ScreenHeight]; // PPU mask bits 5-7 of each line, shifted down
+};
 
-	SetInstruction("BCS");
-}
+FrameBuffer frameBuffers[FrameBufferCount];
+std::atomic<int> frameBufferRefs[FrameBufferCount] = { 1 }; // The PPU holds buffer 0 to start with
+int currentFrameBuffer;
+FrameBuffer* framebuffer = &frameBuffers[0];
 
-// Branch if Equal
-void BEQ(uint8_t value)
+// Headless runs can leave pixels out. Skipped frames still run the whole PPU, so registers,
+// scrolling, sprite 0 hit and the status flags behave the same, they are only not drawn.
+uint32_t renderEvery = 1; // Draw every Nth frame, 0 draws none
+bool renderingFrame = true; // The frame in progress is drawn
+
+struct Frame
 {
-    if(Z)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+	const FrameBuffer* image; // Null when the frame wasn't drawn
+	uint64_t number;
+	int buffer;
+};
 
-	SetInstruction("BEQ");
+void RetainFrame(const Frame& frame)
+{
+	frameBufferRefs[frame.buffer].fetch_add(1, std::memory_order_relaxed);
 }
 
-// Bit Test
-void BIT(uint8_t value)
+void ReleaseFrame(const Frame& frame)
 {
-    uint8_t result = A & value;
-    
-    // Zero flag
-    Z = result == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
-    
-    // Overflow flag
-    V = (value >> 6) & 0x1;
-
-	SetInstruction("BIT");
+	frameBufferRefs[frame.buffer].fetch_sub(1, std::memory_order_release);
 }
 
-void BMI(uint8_t value)
+class FrameSink
 {
-    if (N)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+public:
+	virtual ~FrameSink() {}
 
-	SetInstruction("BMI");
-}
+	// Called on the emulation thread, the frame is only valid until the call
+	// returns unless the sink retains it
+	virtual void OnFrame(const Frame& frame) = 0;
+	virtual void Close() {}
+};
 
-void BNE(uint8_t value)
+std::vector<FrameSink*> frameSinks;
+
+// Picks the next buffer nobody references, waiting for the sinks if they all are
+void AcquireFrameBuffer()
 {
-    if(!Z)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+	for (;;)
+	{
+		for (int i = 1; i <= FrameBufferCount; ++i)
+		{
+			int index = (currentFrameBuffer + i) % FrameBufferCount;
+
+			if (frameBufferRefs[index].load(std::memory_order_acquire) == 0)
+			{
+				frameBufferRefs[index].store(1, std::memory_order_relaxed);
+				currentFrameBuffer = index;
+				framebuffer = &frameBuffers[index];
+				return;
+			}
+		}
 
-	SetInstruction("BNE");
+		std::this_thread::yield();
+	}
 }
 
-void BPL(uint8_t value)
+void PublishFrame(uint64_t number)
 {
-    if (!N)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+	Frame frame = { renderingFrame ? &frameBuffers[currentFrameBuffer] : nullptr, number, currentFrameBuffer };
 
-	SetInstruction("BPL");
+	for (FrameSink* sink : frameSinks)
+	{
+		sink->OnFrame(frame);
+	}
+
+	// Nothing was drawn, the buffer can take the next frame
+	if (!frame.image)
+		return;
+
+	// Drop the PPU's reference and move on to a free buffer
+	ReleaseFrame(frame);
+	AcquireFrameBuffer();
 }
 
-void BRK()
-{
-	uint8_t low = PC & 0xFF;
-	uint8_t high = (PC >> 8) & 0xFF;
+// Pixel conversion
+// Frames are only turned into RGB by the sinks that need it, hashing works on the palette
+// colors directly. Each format's palette is kept as byte planes for every emphasis
+// setting, so a line converts with 16 byte table lookups, one shuffle per plane and
+// quarter of the table, where SSSE3 is available.
 
-	PushStack(low);
-	PushStack(high);
+// 2C02 palette, 0xRRGGBB
+const uint32_t NesPalette[64] =
+{
+	0x666666, 0x002A88, 0x1412A7, 0x3B00A4, 0x5C007E, 0x6E0040, 0x6C0600, 0x561D00,
+	0x333500, 0x0B4800, 0x005200, 0x004F08, 0x00404D, 0x000000, 0x000000, 0x000000,
+	0xADADAD, 0x155FD9, 0x4240FF, 0x7527FE, 0xA01ACC, 0xB71E7B, 0xB53120, 0x994E00,
+	0x6B6D00, 0x388700, 0x0C9300, 0x008F32, 0x007C8D, 0x000000, 0x000000, 0x000000,
+	0xFFFEFF, 0x64B0FF, 0x9290FF, 0xC676FF, 0xF36AFF, 0xFE6ECC, 0xFE8170, 0xEA9E22,
+	0xBCBE00, 0x88D800, 0x5CE430, 0x45E082, 0x48CDDE, 0x4F4F4F, 0x000000, 0x000000,
+	0xFFFEFF, 0xC0DFFF, 0xD3D2FF, 0xE8C8FF, 0xFBC2FF, 0xFEC4EA, 0xFECCC5, 0xF7D8A5,
+	0xE4E594, 0xCFEF96, 0xBDF4AB, 0xB3F3CC, 0xB5EBF2, 0xB8B8B8, 0x000000, 0x000000
+};
 
-	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (V << 6) | (N << 7);
-	P |= (1 << 4);
-	P |= (1 << 5);
+enum PixelFormat
+{
+	PIXEL_RGBA8888, // R, G, B, A bytes
+	PIXEL_RGB565, // Little endian
+	PIXEL_GRAY8,
+	PIXEL_FORMAT_COUNT
+};
 
-	PushStack(P);
+const int PixelSizes[PIXEL_FORMAT_COUNT] = { 4, 2, 1 };
 
-	SetInstruction("BRK");
-}
+// R, G, B for RGBA, the low and high byte for RGB565, one plane for grayscale
+uint8_t outputPlanes[PIXEL_FORMAT_COUNT][8][3][64];
 
-void BVC(uint8_t value)
+bool ParsePixelFormat(const char* name, PixelFormat& format)
 {
-    if(!V)
-    {
-        PC += static_cast<int8_t>(value);
-    }
+	if (strcmp(name, "rgba") == 0)
+		format = PIXEL_RGBA8888;
+	else if (strcmp(name, "rgb565") == 0)
+		format = PIXEL_RGB565;
+	else if (strcmp(name, "gray") == 0)
+		format = PIXEL_GRAY8;
+	else
+		return false;
 
-	SetInstruction("BVC");
+	return true;
 }
 
-void BVS(uint8_t value)
+void BuildOutputPalettes()
 {
-    if (V)
-    {
-        PC += static_cast<int8_t>(value);
-    }
-
-	SetInstruction("BVS");
+	for (int emphasis = 0; emphasis < 8; ++emphasis)
+	{
+		for (int color = 0; color < 64; ++color)
+		{
+			uint32_t rgb = NesPalette[color];
+			double channels[3] = { double(rgb >> 16), double((rgb >> 8) & 0xFF), double(rgb & 0xFF) };
+
+			// Each emphasis bit (red, green, blue) darkens the other two channels
+			for (int bit = 0; bit < 3; ++bit)
+			{
+				if (!(emphasis & (1 << bit)))
+					continue;
+
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					if (channel != bit)
+						channels[channel] *= 0.75;
+				}
+			}
+
+			uint8_t r = static_cast<uint8_t>(lround(channels[0]));
+			uint8_t g = static_cast<uint8_t>(lround(channels[1]));
+			uint8_t b = static_cast<uint8_t>(lround(channels[2]));
+			uint16_t rgb565 = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+
+			outputPlanes[PIXEL_RGBA8888][emphasis][0][color] = r;
+			outputPlanes[PIXEL_RGBA8888][emphasis][1][color] = g;
+			outputPlanes[PIXEL_RGBA8888][emphasis][2][color] = b;
+			outputPlanes[PIXEL_RGB565][emphasis][0][color] = rgb565 & 0xFF;
+			outputPlanes[PIXEL_RGB565][emphasis][1][color] = rgb565 >> 8;
+			outputPlanes[PIXEL_GRAY8][emphasis][0][color] = (r * 299 + g * 587 + b * 114 + 500) / 1000;
+		}
+	}
 }
 
-void CLC()
+#ifdef __SSSE3__
+// Looks up 16 colors in a 64 entry plane. Shuffles index with the low 4 bits, so each
+// quarter of the plane is shuffled and kept where the high bits select it.
+inline __m128i LookupPlane(const uint8_t* plane, __m128i colors, const __m128i* quarters)
 {
-    C = 0;
+	__m128i result = _mm_setzero_si128();
+
+	for (int i = 0; i < 4; ++i)
+	{
+		__m128i table = _mm_loadu_si128((const __m128i*)(plane + i * 16));
+		result = _mm_or_si128(result, _mm_and_si128(_mm_shuffle_epi8(table, colors), quarters[i]));
+	}
 
-	SetInstruction("CLC");
+	return result;
 }
 
-void CLD()
+void ConvertLine(const uint8_t* colors, uint8_t (*planes)[64], PixelFormat format, uint8_t* out)
 {
-    D = 0;
+	for (int x = 0; x < ScreenWidth; x += 16)
+	{
+		__m128i indices = _mm_loadu_si128((const __m128i*)(colors + x));
+		__m128i high = _mm_and_si128(_mm_srli_epi16(indices, 4), _mm_set1_epi8(0x03));
+		__m128i quarters[4];
 
-	SetInstruction("CLD");
-}
+		for (int i = 0; i < 4; ++i)
+		{
+			quarters[i] = _mm_cmpeq_epi8(high, _mm_set1_epi8(i));
+		}
 
-void CLI()
-{
-    I = 0;
+		__m128i first = LookupPlane(planes[0], indices, quarters);
 
-	SetInstruction("CLI");
+		if (format == PIXEL_GRAY8)
+		{
+			_mm_storeu_si128((__m128i*)(out + x), first);
+		}
+		else if (format == PIXEL_RGB565)
+		{
+			__m128i second = LookupPlane(planes[1], indices, quarters);
+			_mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi8(first, second));
+			_mm_storeu_si128((__m128i*)(out + x * 2 + 16), _mm_unpackhi_epi8(first, second));
+		}
+		else
+		{
+			__m128i green = LookupPlane(planes[1], indices, quarters);
+			__m128i blue = LookupPlane(planes[2], indices, quarters);
+			__m128i alpha = _mm_set1_epi8((char)0xFF);
+			__m128i redGreenLow = _mm_unpacklo_epi8(first, green);
+			__m128i redGreenHigh = _mm_unpackhi_epi8(first, green);
+			__m128i blueAlphaLow = _mm_unpacklo_epi8(blue, alpha);
+			__m128i blueAlphaHigh = _mm_unpackhi_epi8(blue, alpha);
+			uint8_t* pixels = out + x * 4;
+
+			_mm_storeu_si128((__m128i*)pixels, _mm_unpacklo_epi16(redGreenLow, blueAlphaLow));
+			_mm_storeu_si128((__m128i*)(pixels + 16), _mm_unpackhi_epi16(redGreenLow, blueAlphaLow));
+			_mm_storeu_si128((__m128i*)(pixels + 32), _mm_unpacklo_epi16(redGreenHigh, blueAlphaHigh));
+			_mm_storeu_si128((__m128i*)(pixels + 48), _mm_unpackhi_epi16(redGreenHigh, blueAlphaHigh));
+		}
+	}
 }
-
-void CLV()
+#else
+void ConvertLine(const uint8_t* colors, uint8_t (*planes)[64], PixelFormat format, uint8_t* out)
 {
-    V = 0;
+	for (int x = 0; x < ScreenWidth; ++x)
+	{
+		uint8_t color = colors[x];
 
-	SetInstruction("CLV");
+		if (format == PIXEL_GRAY8)
+		{
+			out[x] = planes[0][color];
+		}
+		else if (format == PIXEL_RGB565)
+		{
+			out[x * 2] = planes[0][color];
+			out[x * 2 + 1] = planes[1][color];
+		}
+		else
+		{
+			out[x * 4] = planes[0][color];
+			out[x * 4 + 1] = planes[1][color];
+			out[x * 4 + 2] = planes[2][color];
+			out[x * 4 + 3] = 0xFF;
+		}
+	}
 }
+#endif
 
-void CMP(uint8_t value)
+// Converts a drawn frame into ScreenWidth * ScreenHeight pixels of the given format
+void ConvertFrame(const Frame& frame, PixelFormat format, void* out)
 {
-    // Carry flag
-    C = A >= value;
-    
-    // Zero flag
-    Z = A == value;
-    
-    uint8_t result = A - value;
-    
-    // Negative flag
-    N = (result >> 7) & 0x1;
+	uint8_t* bytes = (uint8_t*)out;
+	size_t lineBytes = ScreenWidth * PixelSizes[format];
 
-	SetInstruction("CMP");
+	for (int y = 0; y < ScreenHeight; ++y)
+	{
+		ConvertLine(frame.image->pixels + y * ScreenWidth, outputPlanes[format][frame.image->emphasis[y]], format, bytes + y * lineBytes);
+	}
 }
 
-void CPX(uint8_t value)
+void CloseFrameSinks()
 {
-    // Carry flag
-    C = X >= value;
-    
-    // Zero flag
-    Z = X == value;
-    
-    uint8_t result = X - value;
-    
-    // Negative flag
-    N = (result >> 7) & 0x1;
+	for (FrameSink* sink : frameSinks)
+	{
+		sink->Close();
+		delete sink;
+	}
 
-	SetInstruction("CPX");
+	frameSinks.clear();
 }
 
-void CPY(uint8_t value)
-{
-    // Carry flag
-    C = Y >= value;
-    
-    // Zero flag
-    Z = Y == value;
-    
-    uint8_t result = Y - value;
-    
-    // Negative flag
-    N = (result >> 7) & 0x1;
+// 64 bit xxHash
+const uint64_t XXPrime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t XXPrime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t XXPrime3 = 0x165667B19E3779F9ULL;
+const uint64_t XXPrime4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t XXPrime5 = 0x27D4EB2F165667C5ULL;
 
-	SetInstruction("CPY");
+uint64_t RotateLeft(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
 }
 
-void DEC(uint16_t address)
+uint64_t XXRound(uint64_t accumulator, uint64_t input)
 {
-    uint8_t value = ReadMemory(address);
-    value -= 1;
-    
-    WriteMemory(address, value);
-    
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
+	accumulator += input * XXPrime2;
+	accumulator = RotateLeft(accumulator, 31);
+	return accumulator * XXPrime1;
+}
 
-	SetInstruction("DEC");
+uint64_t XXMerge(uint64_t accumulator, uint64_t value)
+{
+	accumulator ^= XXRound(0, value);
+	return accumulator * XXPrime1 + XXPrime4;
 }
 
-void DEX()
+uint64_t XXHash64(const void* data, size_t size, uint64_t seed)
 {
-    X -= 1;
-    
-    // Zero flag
-    Z = X == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (X >> 7) & 0x1;
+	const uint8_t* p = (const uint8_t*)data;
+	const uint8_t* end = p + size;
+	uint64_t hash;
+	uint64_t lane;
+	uint32_t word;
 
-	SetInstruction("DEX");
-}
+	if (size >= 32)
+	{
+		uint64_t v1 = seed + XXPrime1 + XXPrime2;
+		uint64_t v2 = seed + XXPrime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - XXPrime1;
 
-void DEY()
-{
-    Y -= 1;
-    
-    // Zero flag
-    Z = Y == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (Y >> 7) & 0x1;
+		for (; p + 32 <= end; p += 32)
+		{
+			memcpy(&lane, p, 8);
+			v1 = XXRound(v1, lane);
+			memcpy(&lane, p + 8, 8);
+			v2 = XXRound(v2, lane);
+			memcpy(&lane, p + 16, 8);
+			v3 = XXRound(v3, lane);
+			memcpy(&lane, p + 24, 8);
+			v4 = XXRound(v4, lane);
+		}
 
-	SetInstruction("DEY");
-}
+		hash = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) + RotateLeft(v4, 18);
+		hash = XXMerge(hash, v1);
+		hash = XXMerge(hash, v2);
+		hash = XXMerge(hash, v3);
+		hash = XXMerge(hash, v4);
+	}
+	else
+	{
+		hash = seed + XXPrime5;
+	}
 
-void EOR(uint8_t value)
-{
-    A = A ^ value;
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (A >> 7) & 0x1;
+	hash += size;
 
-	SetInstruction("EOR");
-}
+	for (; p + 8 <= end; p += 8)
+	{
+		memcpy(&lane, p, 8);
+		hash ^= XXRound(0, lane);
+		hash = RotateLeft(hash, 27) * XXPrime1 + XXPrime4;
+	}
 
-void INC(uint16_t address)
-{
-    uint8_t value = ReadMemory(address);
-    value += 1;
-    WriteMemory(address, value);
-    
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
+	if (p + 4 <= end)
+	{
+		memcpy(&word, p, 4);
+		hash ^= word * XXPrime1;
+		hash = RotateLeft(hash, 23) * XXPrime2 + XXPrime3;
+		p += 4;
+	}
 
-	SetInstruction("INC");
-}
+	for (; p < end; ++p)
+	{
+		hash ^= *p * XXPrime5;
+		hash = RotateLeft(hash, 11) * XXPrime1;
+	}
 
-void INX()
-{
-    X += 1;
-    
-    // Zero flag
-    Z = X == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (X >> 7) & 0x1;
+	hash ^= hash >> 33;
+	hash *= XXPrime2;
+	hash ^= hash >> 29;
+	hash *= XXPrime3;
+	hash ^= hash >> 32;
 
-	SetInstruction("INX");
+	return hash;
 }
 
-void INY()
+// Internal and work RAM, the state a frame hash can't see
+uint64_t HashRAM()
 {
-    Y += 1;
-    
-    // Zero flag
-    Z = Y == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (Y >> 7) & 0x1;
-
-	SetInstruction("INY");
+	return XXHash64(SaveWorkRAM, SaveWorkRAMSize, XXHash64(RAM, sizeof(RAM), 0));
 }
 
-void JMP(uint16_t address)
+// Hashes every frame on the emulation thread, hashing is far cheaper than copying. The
+// palette colors and emphasis are hashed, no RGB conversion is needed.
+// Each line is "frame framebuffer-hash ram-hash", which is also the golden file
+// format of the regression runner.
+class HashFrameSink : public FrameSink
 {
-    PC = address;
+public:
+	std::vector<uint64_t> hashes;
+	std::vector<uint64_t> ramHashes;
 
-	SetInstruction("JMP");
-}
+	HashFrameSink(const char* filename)
+	{
+		if (filename)
+			file.open(filename, std::ios::trunc);
+	}
 
-// JSR (Jump To Subroutine
-void JSR(uint16_t address)
-{
-    uint16_t temp = PC - 1;
-    uint8_t low = temp & 0xFF;
-    uint8_t high = (temp >> 8) & 0xFF;
-    
-	PushStack(high);
-	PushStack(low);
-	
-    PC = address;
+	void OnFrame(const Frame& frame) override
+	{
+		uint64_t hash = frame.image ? XXHash64(frame.image, sizeof(FrameBuffer), 0) : 0;
+		uint64_t ramHash = HashRAM();
+		hashes.push_back(hash);
+		ramHashes.push_back(ramHash);
 
-	SetInstruction("JSR");
-}
+		if (file.is_open())
+		{
+			char line[64];
+			sprintf(line, "%llu %016llx %016llx\n", static_cast<unsigned long long>(frame.number),
+				static_cast<unsigned long long>(hash), static_cast<unsigned long long>(ramHash));
+			file << line;
+		}
+	}
 
-void LDA(uint8_t value)
-{
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
-    
-    A = value;
+	void Close() override
+	{
+		file.close();
+	}
 
-	SetInstruction("LDA");
-}
+private:
+	ofstream file;
+};
 
-void LDX(uint8_t value)
+// Base for sinks that do their work on a background thread. Frames are
+// retained while they wait in the queue and released once written.
+class AsyncFrameSink : public FrameSink
 {
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
-    
-    X = value;
+public:
+	void OnFrame(const Frame& frame) override
+	{
+		if (!frame.image || !Wants(frame.number))
+			return;
 
-	SetInstruction("LDX");
-}
+		if (!worker.joinable())
+			worker = std::thread(&AsyncFrameSink::Run, this);
 
-void LDY(uint8_t value)
-{
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (value >> 7) & 0x1;
-    
-    Y = value;
+		RetainFrame(frame);
 
-	SetInstruction("LDY");
-}
+		std::lock_guard<std::mutex> lock(mutex);
+		queue.push_back(frame);
+		wake.notify_one();
+	}
 
-void LSR_A()
-{
-    // Carry flag
-    C = A & 0x01;
-    
-    // Bit 7 is set to 0 after the shift
-    A = (A >> 1) & 0x7F;
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = 0;
+	void Close() override
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closing = true;
+			wake.notify_one();
+		}
 
-	SetInstruction("LSR");
-}
+		if (worker.joinable())
+			worker.join();
+	}
 
-void LSR(uint16_t address)
-{
-    uint8_t value = ReadMemory(address);
-    
-    // Carry flag
-    C = value & 0x01;
-    
-    // Bit 7 is set to 0 after the shift
-    value = (value >> 1) & 0x7F;
-    
-    // Zero flag
-    Z = value == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = 0;
+protected:
+	virtual bool Wants(uint64_t /*number*/) { return true; }
+	virtual void WriteFrame(const Frame& frame) = 0;
 
-	WriteMemory(address, value);
+private:
+	void Run()
+	{
+		for (;;)
+		{
+			Frame frame;
 
-	SetInstruction("LSR");
-}
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [this] { return closing || !queue.empty(); });
 
-void NOP()
-{
-	SetInstruction("NOP");
-}
+				if (queue.empty())
+					return;
 
-void ORA(uint8_t value)
-{
-    A = A | value;
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (A >> 7) & 0x1;
+				frame = queue.front();
+				queue.erase(queue.begin());
+			}
 
-	SetInstruction("ORA");
-}
+			WriteFrame(frame);
+			ReleaseFrame(frame);
+		}
+	}
 
-void PHA()
-{
-	PushStack(A);
+	std::thread worker;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<Frame> queue;
+	bool closing = false;
+};
 
-	SetInstruction("PHA");
-}
+uint32_t crcTable[256];
 
-void PHP()
+uint32_t CRC32(uint32_t crc, const uint8_t* data, size_t size)
 {
-    uint8_t P = C | ( Z << 1) | ( I << 2) | (D << 3) | (V << 6) | (N << 7);
-    P |= (1 << 4);
-    P |= (1 << 5);
-    
-	PushStack(P);
+	if (!crcTable[1])
+	{
+		for (uint32_t i = 0; i < 256; ++i)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			crcTable[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = crcTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
 
-	SetInstruction("PHP");
+	return ~crc;
 }
 
-void PLA()
+void AppendBigEndian(std::vector<uint8_t>& out, uint32_t value)
 {
-	A = PullStack();
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (A >> 7) & 0x1;
-
-	SetInstruction("PLA");
+	out.push_back(value >> 24);
+	out.push_back((value >> 16) & 0xFF);
+	out.push_back((value >> 8) & 0xFF);
+	out.push_back(value & 0xFF);
 }
 
-void PLP()
+void AppendPngChunk(std::vector<uint8_t>& out, const char* type, const std::vector<uint8_t>& data)
 {
-	uint8_t P = PullStack();
+	AppendBigEndian(out, static_cast<uint32_t>(data.size()));
 
-	C = P & 0x01;
-	Z = (P >> 1) & 0x01;
-	I = (P >> 2) & 0x01;
-	D = (P >> 3) & 0x01;
-	V = (P >> 6) & 0x01;
-	N = (P >> 7) & 0x01;
+	size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data.begin(), data.end());
 
-	SetInstruction("PLP");
+	AppendBigEndian(out, CRC32(0, out.data() + start, out.size() - start));
 }
 
-void ROL_A()
+// RGB PNG using stored (uncompressed) deflate blocks, which keeps the encoder trivial
+void EncodePng(const uint32_t* pixels, std::vector<uint8_t>& out)
 {
-	uint8_t newBitZero = C;
-
-	// Carry flag becomes the old bit 7
-	C = (A >> 7) & 0x01;
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	out.assign(signature, signature + 8);
+
+	std::vector<uint8_t> header;
+	AppendBigEndian(header, ScreenWidth);
+	AppendBigEndian(header, ScreenHeight);
+	header.push_back(8); // Bit depth
+	header.push_back(2); // Truecolour
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	AppendPngChunk(out, "IHDR", header);
+
+	// Each row starts with filter type 0
+	std::vector<uint8_t> raw;
+	raw.reserve(ScreenHeight * (ScreenWidth * 3 + 1));
+
+	for (int y = 0; y < ScreenHeight; ++y)
+	{
+		raw.push_back(0);
 
-	A = (A << 1);
+		const uint8_t* row = (const uint8_t*)(pixels + y * ScreenWidth);
+		for (int x = 0; x < ScreenWidth; ++x)
+		{
+			raw.insert(raw.end(), row + x * 4, row + x * 4 + 3);
+		}
+	}
 
-	// The first bit should be 0 now due to the bit shift.
-	A |= newBitZero;
+	std::vector<uint8_t> zlib = { 0x78, 0x01 };
+	uint32_t a = 1, b = 0;
 
-	// Zero flag
-	Z = A == 0 ? 1 : 0;
+	for (size_t offset = 0; offset < raw.size(); offset += 65535)
+	{
+		size_t length = raw.size() - offset < 65535 ? raw.size() - offset : 65535;
+
+		zlib.push_back(offset + length == raw.size() ? 1 : 0);
+		zlib.push_back(length & 0xFF);
+		zlib.push_back(length >> 8);
+		zlib.push_back(~length & 0xFF);
+		zlib.push_back((~length >> 8) & 0xFF);
+		zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+	}
 
-	// Negative flag
-	N = (A >> 7) & 0x1;
+	for (uint8_t value : raw)
+	{
+		a = (a + value) % 65521;
+		b = (b + a) % 65521;
+	}
 
-	SetInstruction("ROL");
+	AppendBigEndian(zlib, (b << 16) | a);
+	AppendPngChunk(out, "IDAT", zlib);
+	AppendPngChunk(out, "IEND", std::vector<uint8_t>());
 }
 
-void ROL(uint16_t address)
+// Writes selected frames as PPM or PNG images named <prefix><frame number>.<ext>
+class ImageFrameSink : public AsyncFrameSink
 {
-	uint8_t value = ReadMemory(address);
+public:
+	ImageFrameSink(const char* prefix, bool png, uint64_t first, uint64_t last, uint64_t every)
+		: prefix(prefix), png(png), first(first), last(last), every(every ? every : 1)
+	{
+	}
 
-	uint8_t newBitZero = C;
+protected:
+	bool Wants(uint64_t number) override
+	{
+		return number >= first && number <= last && (number - first) % every == 0;
+	}
 
-	// Carry flag becomes the old bit 7
-	C = (value >> 7) & 0x01;
+	void WriteFrame(const Frame& frame) override
+	{
+		char filename[512];
+		snprintf(filename, sizeof(filename), "%s%06llu.%s", prefix.c_str(), static_cast<unsigned long long>(frame.number), png ? "png" : "ppm");
 
-	value = value << 1;
+		ofstream file(filename, std::ios::binary | std::ios::trunc);
+		ConvertFrame(frame, PIXEL_RGBA8888, rgba);
 
-	// The first bit should be 0 now due to the bit shift.
-	value |= newBitZero;
+		if (png)
+		{
+			EncodePng(rgba, encoded);
+		}
+		else
+		{
+			char header[32];
+			int length = sprintf(header, "P6\n%d %d\n255\n", ScreenWidth, ScreenHeight);
 
-	// Zero flag
-	Z = value == 0 ? 1 : 0;
+			encoded.assign(header, header + length);
 
-	// Negative flag
-	N = (value >> 7) & 0x1;
+			const uint8_t* bytes = (const uint8_t*)rgba;
+			for (int i = 0; i < ScreenWidth * ScreenHeight; ++i)
+			{
+				encoded.insert(encoded.end(), bytes + i * 4, bytes + i * 4 + 3);
+			}
+		}
 
-	WriteMemory(address, value);
+		file.write((char*)encoded.data(), encoded.size());
+	}
 
-	SetInstruction("ROL");
-}
+private:
+	std::string prefix;
+	bool png;
+	uint64_t first;
+	uint64_t last;
+	uint64_t every;
+	uint32_t rgba[ScreenWidth * ScreenHeight];
+	std::vector<uint8_t> encoded;
+};
 
-void ROR_A()
+// Appends every frame as raw pixels to a file for later encoding, e.g.
+// ffmpeg -f rawvideo -pix_fmt rgba -s 256x240 -r 60 -i frames.raw out.mp4
+// with rgb565le or gray as the pixel format for the other formats. The file is grown
+// and mapped a chunk of frames at a time, frames are converted straight into it.
+class RawFrameSink : public AsyncFrameSink
 {
-	uint8_t newLastBit = C;
+public:
+	static const size_t ChunkFrames = 64;
 
-	// Carry flag becomes the old bit 7
-	C = A & 0x01;
+	RawFrameSink(const char* filename, PixelFormat format)
+		: format(format), FrameBytes(ScreenWidth * ScreenHeight * PixelSizes[format])
+	{
+#ifdef _WIN32
+		file.open(filename, std::ios::binary | std::ios::trunc);
+#else
+		descriptor = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	}
 
-	A = (A >> 1) & 0x7F;
+	void Close() override
+	{
+		AsyncFrameSink::Close();
 
-	// The last bit should be 0 due to masking with 0x7F.
-	A |= (newLastBit << 7);
+#ifdef _WIN32
+		file.close();
+#else
+		if (chunk)
+			munmap(chunk, ChunkFrames * FrameBytes);
 
-	// Zero flag
-	Z = A == 0 ? 1 : 0;
+		if (descriptor >= 0)
+		{
+			// Trim the unused part of the last chunk
+			if (ftruncate(descriptor, written * FrameBytes) != 0)
+				printf("Could not truncate raw frame file\n");
 
-	// Negative flag
-	N = (A >> 7) & 0x1;
+			close(descriptor);
+		}
 
-	SetInstruction("ROR");
-}
+		chunk = nullptr;
+		descriptor = -1;
+#endif
+	}
 
-void ROR(uint16_t address)
-{
-	uint8_t value = ReadMemory(address);
+protected:
+	void WriteFrame(const Frame& frame) override
+	{
+#ifdef _WIN32
+		converted.resize(FrameBytes);
+		ConvertFrame(frame, format, converted.data());
+		file.write((const char*)converted.data(), FrameBytes);
+#else
+		if (descriptor < 0)
+			return;
 
-	uint8_t newLastBit = C;
+		size_t slot = written % ChunkFrames;
 
-	// Carry flag becomes the old bit 7
-	C = value & 0x01;
+		if (slot == 0)
+		{
+			if (chunk)
+				munmap(chunk, ChunkFrames * FrameBytes);
+
+			off_t offset = static_cast<off_t>(written * FrameBytes);
+			chunk = nullptr;
+
+			if (ftruncate(descriptor, offset + ChunkFrames * FrameBytes) == 0)
+			{
+				void* mapping = mmap(nullptr, ChunkFrames * FrameBytes, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, offset);
+
+				if (mapping != MAP_FAILED)
+					chunk = (uint8_t*)mapping;
+			}
+
+			if (!chunk)
+			{
+				printf("Could not map raw frame file\n");
+				close(descriptor);
+				descriptor = -1;
+				return;
+			}
+		}
 
-	value = (value >> 1) & 0x7F;
+		ConvertFrame(frame, format, chunk + slot * FrameBytes);
+#endif
+		++written;
+	}
 
-	// The last bit should be 0 due to masking with 0x7F.
-	value |= (newLastBit << 7);
+private:
+	PixelFormat format;
+	const size_t FrameBytes;
+	size_t written = 0;
+#ifdef _WIN32
+	ofstream file;
+	std::vector<uint8_t> converted;
+#else
+	int descriptor = -1;
+	uint8_t* chunk = nullptr;
+#endif
+};
 
-	// Zero flag
-	Z = value == 0 ? 1 : 0;
+// PPU
+// Scanline renderer. The PPU is caught up lazily: when the CPU touches a PPU
+// register and at the start of every scanline, all scanlines whose start time
+// has passed are processed. Each visible line is rendered in one pass at its
+// start using the scroll position at that time, so scroll writes made during a
+// line take effect on the next one.
 
-	// Negative flag
-	N = (value >> 7) & 0x1;
+const int DotsPerScanline = 341;
+const int ScanlinesPerFrame = 262;
 
-	WriteMemory(address, value);
+enum Mirroring
+{
+	MIRROR_HORIZONTAL,
+	MIRROR_VERTICAL
+};
 
-	SetInstruction("ROR");
+uint8_t CHR[8192]; // CHR RAM
+uint8_t* patternTables = CHR; // CHR RAM, or the cartridge's shared CHR ROM
+uint8_t nametables[2048];
+uint8_t paletteRAM[32];
+Mirroring mirroring;
+bool chrRAM; // Carts without CHR ROM have writable pattern tables
+
+// Internal registers, v is the current VRAM address, t the temporary address,
+// x the fine X scroll and w the $2005/$2006 write toggle
+uint16_t ppuV;
+uint16_t ppuT;
+uint8_t ppuX;
+uint8_t ppuW;
+uint8_t ppuReadBuffer;
+
+int ppuScanline; // Next scanline to start
+uint64_t ppuNextLine; // PPU dot at which it starts
+bool ppuOddFrame;
+bool nmiPending;
+bool frameReady;
+
+// Background pixels of the current line as palette indices, 0 is transparent
+uint8_t backgroundLine[ScreenWidth + 16];
+
+bool RenderingEnabled()
+{
+	return (PPU[1] & 0x18) != 0;
 }
 
-void RTI()
+uint16_t NametableAddress(uint16_t address)
 {
-	uint8_t P = PullStack();
-	C = P & 0x01;
-	Z = (P >> 1) & 0x01;
-	I = (P >> 2) & 0x01;
-	D = (P >> 3) & 0x01;
-	V = (P >> 6) & 0x01;
-	N = (P >> 7) & 0x01;
-
-	uint8_t low = PullStack();
-	uint8_t high = PullStack();
-	
-	PC = low | (high << 8);
+	if (mirroring == MIRROR_VERTICAL)
+		return address & 0x07FF;
 
-	SetInstruction("RTI");
+	return ((address >> 1) & 0x0400) | (address & 0x03FF);
 }
 
-void RTS()
+// Tile decode cache
+// Pattern rows are decoded from 2 bits per pixel into one byte per pixel the first time
+// they are drawn, in both orientations so flipped sprites are a plain copy too. Tiles stay
+// decoded until CHR RAM under them is written or the pattern tables are swapped.
+struct DecodedTileRow
 {
-	uint8_t low = PullStack();
-	uint8_t high = PullStack();
-	
-	uint16_t address = low | (high << 8);
-	PC = address + 1;
+	uint8_t pixels[8]; // Pixel values 0-3, left to right
+	uint8_t flipped[8]; // Right to left
+};
 
-	SetInstruction("RTS");
-}
+DecodedTileRow tileRows[512 * 8]; // Indexed by tile and row
+bool tileValid[512];
 
-void SBC(uint8_t value)
+void InvalidateTiles()
 {
-	value = value ^ 0xFF;
+	memset(tileValid, 0, sizeof(tileValid));
+}
 
-	uint16_t result = A + value + C;
+// Row of the tile at a pattern address (plane 0), decoding the tile if needed
+const DecodedTileRow& TileRow(uint16_t pattern)
+{
+	uint16_t tile = (pattern >> 4) & 0x01FF;
 
-	// Carry flag
-	C = (result & 0x100) >> 8;
+	if (!tileValid[tile])
+	{
+		for (int row = 0; row < 8; ++row)
+		{
+			uint8_t low = patternTables[(tile << 4) + row];
+			uint8_t high = patternTables[(tile << 4) + row + 8];
+			DecodedTileRow& decoded = tileRows[(tile << 3) + row];
+
+			for (int i = 0; i < 8; ++i)
+			{
+				uint8_t pixel = ((low >> (7 - i)) & 0x01) | (((high >> (7 - i)) & 0x01) << 1);
+				decoded.pixels[i] = pixel;
+				decoded.flipped[7 - i] = pixel;
+			}
+		}
 
-	// Overflow flag
-	V = (((A ^ result) & (value ^ result) & 0x80) >> 7) & 0x01;
+		tileValid[tile] = true;
+	}
 
-	A = result & 0xFF;
+	return tileRows[(tile << 3) + (pattern & 0x07)];
+}
 
-	// Zero flag
-	Z = A == 0 ? 1 : 0;
+uint8_t PaletteAddress(uint16_t address)
+{
+	// $3F10/$3F14/$3F18/$3F1C mirror the background entries
+	uint8_t index = address & 0x1F;
 
-	// Negative flag
-	N = (A >> 7) & 0x1;
+	if ((index & 0x13) == 0x10)
+		index &= 0x0F;
 
-	SetInstruction("SBC");
+	return index;
 }
 
-void SEC()
+uint8_t ReadVRAM(uint16_t address)
 {
-	C = 1;
+	address &= 0x3FFF;
 
-	SetInstruction("SEC");
+	if (address < 0x2000)
+		return patternTables[address];
+	else if (address < 0x3F00)
+		return nametables[NametableAddress(address)];
+
+	return paletteRAM[PaletteAddress(address)];
 }
 
-void SED()
+void WriteVRAM(uint16_t address, uint8_t value)
 {
-	D = 1;
+	address &= 0x3FFF;
 
-	SetInstruction("SED");
+	if (address < 0x2000)
+	{
+		if (chrRAM)
+		{
+			CHR[address] = value;
+			tileValid[address >> 4] = false;
+		}
+	}
+	else if (address < 0x3F00)
+	{
+		nametables[NametableAddress(address)] = value;
+	}
+	else
+	{
+		paletteRAM[PaletteAddress(address)] = value & 0x3F;
+	}
 }
 
-void SEI()
+void RenderBackground()
 {
-	I = 1;
+	uint16_t v = ppuV;
+	uint16_t patternBase = (PPU[0] & 0x10) << 8;
+	uint16_t fineY = (v >> 12) & 0x07;
 
-	SetInstruction("SEI");
-}
+	// 33 tiles cover the line for any fine X scroll
+	for (int tile = 0; tile < 33; ++tile)
+	{
+		uint8_t index = nametables[NametableAddress(0x2000 | (v & 0x0FFF))];
+		uint8_t attribute = nametables[NametableAddress(0x23C0 | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07))];
+		uint8_t palette = ((attribute >> (((v >> 4) & 0x04) | (v & 0x02))) & 0x03) << 2;
 
-void STA(uint16_t address)
-{
-	WriteMemory(address, A);
+		const uint8_t* pixels = TileRow(patternBase + index * 16 + fineY).pixels;
+
+		uint8_t* out = backgroundLine + tile * 8;
+		for (int i = 0; i < 8; ++i)
+		{
+			out[i] = pixels[i] ? palette | pixels[i] : 0;
+		}
 
-	SetInstruction("STA");
+		// Coarse X increment, wrapping into the next horizontal nametable
+		if ((v & 0x001F) == 31)
+			v = (v & ~0x001F) ^ 0x0400;
+		else
+			++v;
+	}
 }
 
-void STX(uint16_t address)
+// Sprites
+// OAM is scanned once per line into a list of the first 8 sprites on it, with their decoded
+// pattern rows picked up front. The list is drawn into a line buffer and composited
+// over the background for the whole line at once.
+struct LineSprite
 {
-	WriteMemory(address, X);
+	uint8_t x;
+	uint8_t attributes;
+	const uint8_t* pixels; // Decoded pattern row, already flipped
+	bool zero; // OAM entry 0, for sprite 0 hit
+};
 
-	SetInstruction("STX");
-}
+LineSprite lineSprites[8];
+int lineSpriteCount;
 
-void STY(uint16_t address)
+uint8_t spritePixels[ScreenWidth + 8]; // Palette index of the front sprite pixel, 0 if none
+uint8_t spriteBehind[ScreenWidth + 8]; // 0xFF where that pixel is behind the background
+
+uint16_t SpritePatternAddress(uint8_t tile, int row)
 {
-	WriteMemory(address, Y);
+	// 8x16 sprites pick the pattern table with bit 0 of the tile index
+	if (PPU[0] & 0x20)
+		return ((tile & 0x01) << 12) | ((tile & 0xFE) << 4) | ((row & 0x08) << 1) | (row & 0x07);
 
-	SetInstruction("STY");
+	return ((PPU[0] & 0x08) << 9) | (tile << 4) | row;
 }
 
-void TAX()
+// Finds the sprites on a line, OAM holds the Y position minus one. A ninth sprite sets the
+// overflow flag, the hardware's buggy search after the eighth isn't reproduced.
+void EvaluateSprites(int line)
 {
-    X = A;
-    
-    // Zero flag
-    Z = X == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (X >> 7) & 0x1;
+	int height = (PPU[0] & 0x20) ? 16 : 8;
+	lineSpriteCount = 0;
 
-	SetInstruction("TAX");
-}
+	for (int i = 0; i < 64; ++i)
+	{
+		const uint8_t* sprite = OAM + i * 4;
+		int row = line - (sprite[0] + 1);
 
-void TAY()
-{
-    Y = A;
-    
-    // Zero flag
-    Z = Y == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (Y >> 7) & 0x1;
+		if (row < 0 || row >= height)
+			continue;
 
-	SetInstruction("TAY");
-}
+		if (lineSpriteCount == 8)
+		{
+			PPU[2] |= 0x20;
+			break;
+		}
 
-void TSX()
-{
-    X = SP;
-    
-    // Zero flag
-    Z = X == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (X >> 7) & 0x1;
+		// Vertical flip
+		if (sprite[2] & 0x80)
+			row = height - 1 - row;
+
+		const DecodedTileRow& decoded = TileRow(SpritePatternAddress(sprite[1], row));
+		LineSprite& entry = lineSprites[lineSpriteCount++];
 
-	SetInstruction("TSX");
+		entry.x = sprite[3];
+		entry.attributes = sprite[2];
+		entry.pixels = (sprite[2] & 0x40) ? decoded.flipped : decoded.pixels;
+		entry.zero = i == 0;
+	}
 }
 
-// TXA (Transfer X to Accumulator)
-void TXA()
+// Sprite 0 hit is set where an opaque pixel of sprite 0 meets an opaque background pixel.
+// Lines are handled whole, so the flag rises at the start of the line.
+void CheckSpriteZeroHit(const uint8_t* background)
 {
-    A = X;
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (A >> 7) & 0x1;
+	if ((PPU[2] & 0x40) || (PPU[1] & 0x18) != 0x18 || lineSpriteCount == 0 || !lineSprites[0].zero)
+		return;
 
-	SetInstruction("TXA");
-}
+	const LineSprite& sprite = lineSprites[0];
 
-// TXS (Transfer X to Stack Pointer)
-void TXS()
-{
-    SP = X;
+	for (int i = 0; i < 8; ++i)
+	{
+		int x = sprite.x + i;
 
-	SetInstruction("TXS");
+		// No hit at x = 255, or in the left 8 pixels while either layer is clipped there
+		if (x >= 255 || (x < 8 && (PPU[1] & 0x06) != 0x06))
+			continue;
+
+		if (sprite.pixels[i] && background[x])
+		{
+			PPU[2] |= 0x40;
+			return;
+		}
+	}
 }
 
-// TYA (Transfer Y to Accumulator)
-void TYA()
+// Composites the line's sprites into the background palette indices
+void RenderSprites(uint8_t* background)
 {
-    A = Y;
-    
-    // Zero flag
-    Z = A == 0 ? 1 : 0;
-    
-    // Negative flag
-    N = (A >> 7) & 0x1;
+	memset(spritePixels, 0, sizeof(spritePixels));
+
+	// The first opaque sprite pixel in OAM order wins, priority bit included,
+	// so later sprites are drawn first and overwritten
+	for (int i = lineSpriteCount - 1; i >= 0; --i)
+	{
+		const LineSprite& sprite = lineSprites[i];
+		uint8_t palette = 0x10 | ((sprite.attributes & 0x03) << 2);
+		uint8_t behind = (sprite.attributes & 0x20) ? 0xFF : 0x00;
+
+		for (int bit = 0; bit < 8; ++bit)
+		{
+			if (sprite.pixels[bit])
+			{
+				spritePixels[sprite.x + bit] = palette | sprite.pixels[bit];
+				spriteBehind[sprite.x + bit] = behind;
+			}
+		}
+	}
+
+	// Left 8 pixel clipping
+	if (!(PPU[1] & 0x04))
+		memset(spritePixels, 0, 8);
+
+	// A sprite pixel shows where it's opaque and either in front or over a transparent background
+	for (int x = 0; x < ScreenWidth; ++x)
+	{
+		uint8_t sprite = spritePixels[x];
+		uint8_t show = (sprite ? 0xFF : 0x00) & (~spriteBehind[x] | (background[x] ? 0x00 : 0xFF));
 
-	SetInstruction("TYA");
+		background[x] = (background[x] & ~show) | (sprite & show);
+	}
 }
 
-void SimulatePPU()
+// Skipped frames still find each line's sprites for the overflow flag, and only decode
+// the background of lines sprite 0 could hit on
+void SkipScanline(int line)
 {
-	static int i = 0;
-	++i;
+	EvaluateSprites(line);
 
-	if (i == 1000)
+	if (!(PPU[2] & 0x40) && (PPU[1] & 0x18) == 0x18 && lineSpriteCount && lineSprites[0].zero)
 	{
-		WriteMemory(0x2002, 0x80);
-		i = 0;
+		RenderBackground();
+		CheckSpriteZeroHit(backgroundLine + ppuX);
 	}
 }
 
-void ProcessInstruction()
+void RenderScanline(int line)
 {
-	logAddress = PC;
+	uint8_t* out = framebuffer->pixels + line * ScreenWidth;
+	uint8_t* background = backgroundLine + ppuX;
 
-	if (PC == 0xE462)
-		++e462counter;
+	if (PPU[1] & 0x08)
+	{
+		RenderBackground();
 
-	uint8_t opcode = ReadMemory(PC++);
+		// Left 8 pixel clipping
+		if (!(PPU[1] & 0x02))
+			memset(background, 0, 8);
+	}
+	else
+	{
+		memset(background, 0, ScreenWidth);
+	}
 
-	switch (opcode)
+	if (RenderingEnabled())
 	{
+		EvaluateSprites(line);
+		CheckSpriteZeroHit(background);
 
-		// ADC (Add with carry)
-	case 0x69:
-		ADC(Immediate());
-		break;
+		if (PPU[1] & 0x10)
+			RenderSprites(background);
+	}
 
-	case 0x65:
-		ADC(ZeroPage());
-		break;
+	// Grayscale
+	uint8_t mask = (PPU[1] & 0x01) ? 0x30 : 0x3F;
 
-	case 0x75:
-		ADC(ZeroPageX());
-		break;
+	for (int x = 0; x < ScreenWidth; ++x)
+	{
+		out[x] = paletteRAM[background[x]] & mask;
+	}
 
-	case 0x6D:
-		ADC(Absolute());
-		break;
+	framebuffer->emphasis[line] = PPU[1] >> 5;
+}
 
-	case 0x7D:
-		ADC(AbsoluteX());
-		break;
+void IncrementY()
+{
+	if ((ppuV & 0x7000) != 0x7000)
+	{
+		ppuV += 0x1000;
+		return;
+	}
 
-	case 0x79:
-		ADC(AbsoluteY());
-		break;
+	ppuV &= ~0x7000;
+	uint16_t y = (ppuV & 0x03E0) >> 5;
 
-	case 0x61:
-		ADC(IndirectX());
-		break;
+	if (y == 29)
+	{
+		y = 0;
+		ppuV ^= 0x0800;
+	}
+	else if (y == 31)
+	{
+		y = 0;
+	}
+	else
+	{
+		++y;
+	}
 
-	case 0x71:
-		ADC(IndirectY());
-		break;
+	ppuV = (ppuV & ~0x03E0) | (y << 5);
+}
 
-		// AND
-	case 0x29:
-		AND(Immediate());
-		break;
+void StartScanline(int line)
+{
+	int length = DotsPerScanline;
 
-	case 0x25:
-		AND(ZeroPage());
-		break;
+	if (line < ScreenHeight)
+	{
+		if (line == 0)
+			renderingFrame = renderEvery != 0 && (frameCount + 1) % renderEvery == 0;
 
-	case 0x35:
-		AND(ZeroPageX());
-		break;
+		if (RenderingEnabled())
+		{
+			// The pre-render line copies all of t into v
+			if (line == 0)
+				ppuV = ppuT;
+
+			if (renderingFrame)
+				RenderScanline(line);
+			else
+				SkipScanline(line);
+
+			// Dots 256 and 257, next fine Y and reload the horizontal position
+			IncrementY();
+			ppuV = (ppuV & ~0x041F) | (ppuT & 0x041F);
+		}
+		else if (renderingFrame)
+		{
+			RenderScanline(line);
+		}
+	}
+	else if (line == ScreenHeight)
+	{
+		frameReady = true;
+	}
+	else if (line == 241)
+	{
+		// Vertical blank
+		PPU[2] |= 0x80;
 
-	case 0x2D:
-		AND(Absolute());
-		break;
+		if (PPU[0] & 0x80)
+			nmiPending = true;
+	}
+	else if (line == ScanlinesPerFrame - 1)
+	{
+		PPU[2] &= 0x1F;
 
-	case 0x3D:
-		AND(AbsoluteX());
-		break;
+		// The pre-render line is a dot shorter on odd frames when rendering
+		if (ppuOddFrame && RenderingEnabled())
+			--length;
 
-	case 0x39:
-		AND(AbsoluteY());
-		break;
+		ppuOddFrame = !ppuOddFrame;
+	}
 
-	case 0x21:
-		AND(IndirectX());
-		break;
+	ppuNextLine += length;
+	ppuScanline = line + 1 == ScanlinesPerFrame ? 0 : line + 1;
+}
 
-	case 0x31:
-		AND(IndirectY());
-		break;
+// Catch the PPU up to the given CPU cycle
+void RunPPU(uint64_t end)
+{
+	uint64_t dot = end * 3;
 
-		// ASL (Arithmetic Shift Left)
-	case 0x0A:
-		Accumulator();
-		ASL_A();
-		break;
+	while (ppuNextLine <= dot)
+	{
+		StartScanline(ppuScanline);
+	}
 
-	case 0x06:
-		ASL(ZeroPageAddress());
-		break;
+	// Hand control back to the main loop straight away for an NMI or a finished frame
+	if (nmiPending || frameReady)
+		ScheduleEvent(EVENT_PPU, 0);
+	else
+		ScheduleEvent(EVENT_PPU, (ppuNextLine + 2) / 3);
+}
 
-	case 0x16:
-		ASL(ZeroPageXAddress());
-		break;
+uint8_t ReadPPURegister(uint16_t address)
+{
+	RunPPU(cycles);
 
-	case 0x0E:
-		ASL(AbsoluteAddress());
-		break;
+	uint8_t value = PPU[address & 0x0007];
 
-	case 0x1E:
-		ASL(AbsoluteXAddress());
-		break;
+	switch (address & 0x0007)
+	{
+		case 2:
+			// Rest last bit
+			PPU[2] &= 0x7F;
+			ppuW = 0;
+			break;
+		case 4:
+			value = OAM[PPU[3]];
+			break;
+		case 7:
+			// Reads below the palette are delayed by one through a buffer
+			if ((ppuV & 0x3FFF) < 0x3F00)
+			{
+				value = ppuReadBuffer;
+				ppuReadBuffer = ReadVRAM(ppuV);
+			}
+			else
+			{
+				value = ReadVRAM(ppuV);
+				ppuReadBuffer = ReadVRAM(ppuV - 0x1000);
+			}
+
+			ppuV += (PPU[0] & 0x04) ? 32 : 1;
+			break;
+	}
 
-		// BCC (Branch if Carry Clear)
-	case 0x90:
-		BCC(Relative());
-		break;
+	return value;
+}
 
-		// BCS (Branch if Carry Set)
-	case 0xB0:
-		BCS(Relative());
-		break;
+void WritePPURegister(uint16_t address, uint8_t value)
+{
+	RunPPU(cycles);
 
-		// BEQ (Branch if Equal)
-	case 0xF0:
-		BEQ(Relative());
-		break;
+	uint8_t reg = address & 0x0007;
 
-		// BIT (Bit Test)
-	case 0x24:
-		BIT(ZeroPage());
-		break;
+	switch (reg)
+	{
+		case 0:
+			// Enabling NMI during vertical blank raises one immediately
+			if (!(PPU[0] & 0x80) && (value & 0x80) && (PPU[2] & 0x80))
+			{
+				nmiPending = true;
+				ScheduleEvent(EVENT_PPU, 0);
+			}
+
+			ppuT = (ppuT & 0xF3FF) | ((value & 0x03) << 10);
+			break;
+		case 2:
+			// Status is read only
+			return;
+		case 4:
+			// OAMDATA writes increment OAMADDR
+			OAM[PPU[3]++] = value;
+			return;
+		case 5:
+			if (!ppuW)
+			{
+				ppuT = (ppuT & ~0x001F) | (value >> 3);
+				ppuX = value & 0x07;
+			}
+			else
+			{
+				ppuT = (ppuT & 0x8C1F) | ((value & 0x07) << 12) | ((value & 0xF8) << 2);
+			}
+
+			ppuW ^= 1;
+			break;
+		case 6:
+			if (!ppuW)
+			{
+				ppuT = (ppuT & 0x00FF) | ((value & 0x3F) << 8);
+			}
+			else
+			{
+				ppuT = (ppuT & 0xFF00) | value;
+				ppuV = ppuT;
+			}
+
+			ppuW ^= 1;
+			break;
+		case 7:
+			WriteVRAM(ppuV, value);
+			ppuV += (PPU[0] & 0x04) ? 32 : 1;
+			break;
+	}
 
-	case 0x2C:
-		BIT(Absolute());
-		break;
+	PPU[reg] = value;
+}
 
-		// BMI (Branch if Minus)
-	case 0x30:
-		BMI(Relative());
-		break;
+void ResetPPU()
+{
+	memset(PPU, 0, sizeof(PPU));
+	memset(nametables, 0, sizeof(nametables));
+	memset(paletteRAM, 0, sizeof(paletteRAM));
+
+	InvalidateTiles();
+	lineSpriteCount = 0;
+	ppuV = 0;
+	ppuT = 0;
+	ppuX = 0;
+	ppuW = 0;
+	ppuReadBuffer = 0;
+	ppuScanline = 0;
+	ppuNextLine = cycles * 3;
+	ScheduleEvent(EVENT_PPU, cycles);
+	ppuOddFrame = false;
+	nmiPending = false;
+	frameReady = false;
+}
 
-		// BNE (Branch if Not Equal)
-	case 0xD0:
-		BNE(Relative());
-		break;
+// Controllers
+// Standard joypads on $4016/$4017. Button bits are A, B, Select, Start, Up,
+// Down, Left, Right from bit 0 up, the order they are shifted out in.
 
-		// BPL (Branch if Positive)
-	case 0x10:
-		BPL(Relative());
-		break;
+const uint8_t BUTTON_A = 0x01;
+const uint8_t BUTTON_B = 0x02;
+const uint8_t BUTTON_SELECT = 0x04;
+const uint8_t BUTTON_START = 0x08;
+const uint8_t BUTTON_UP = 0x10;
+const uint8_t BUTTON_DOWN = 0x20;
+const uint8_t BUTTON_LEFT = 0x40;
+const uint8_t BUTTON_RIGHT = 0x80;
 
-		// BRK (Force Interrupt)
-	case 0x00:
-		Implicit();
-		BRK();
-		break;
+uint8_t controllerButtons[2]; // Buttons currently held
+uint8_t controllerShift[2]; // Shift registers, reloaded while strobe is high
+uint8_t controllerStrobe;
 
-		// BVC (Branch if Overflow Clear)
-	case 0x50:
-		BVC(Relative());
-		break;
+uint8_t ReadController(int port)
+{
+	if (controllerStrobe)
+		controllerShift[port] = controllerButtons[port];
 
-		// BVS (Branch if Overflow Set)
-	case 0x70:
-		BVS(Relative());
-		break;
+	uint8_t value = controllerShift[port] & 0x01;
 
-		// CLC (Clear Carry Flag)
-	case 0x18:
-		Implicit();
-		CLC();
-		break;
+	// Official pads return 1 once all 8 buttons have been read
+	controllerShift[port] = (controllerShift[port] >> 1) | 0x80;
 
-		// CLD (Clear Decimal Mode)
-	case 0xD8:
-		Implicit();
-		CLD();
-		break;
+	// The upper bits are open bus, which is nearly always the $40 of the address
+	return value | 0x40;
+}
 
-		// CLI (Clear Interrupt Disable)
-	case 0x58:
-		Implicit();
-		CLI();
-		break;
+void WriteControllerStrobe(uint8_t value)
+{
+	controllerStrobe = value & 0x01;
 
-		// CLV (Clear Overflow Flag)
-	case 0xB8:
-		Implicit();
-		CLV();
-		break;
+	if (controllerStrobe)
+	{
+		controllerShift[0] = controllerButtons[0];
+		controllerShift[1] = controllerButtons[1];
+	}
+}
 
-		// CMP (Compare)
-	case 0xC9:
-		CMP(Immediate());
-		break;
+void ResetControllers()
+{
+	memset(controllerButtons, 0, sizeof(controllerButtons));
+	memset(controllerShift, 0, sizeof(controllerShift));
+	controllerStrobe = 0;
+}
 
-	case 0xC5:
-		CMP(ZeroPage());
-		break;
+// Scripted input, a text file with one "frame pad1 [pad2]" line per change.
+// Pads are written as button letters (A B s S U D L R, s is Select) or "." for
+// none, and are held from that frame until the next line.
+struct InputEvent
+{
+	uint64_t frame;
+	uint8_t buttons[2];
+};
 
-	case 0xD5:
-		CMP(ZeroPageX());
-		break;
+std::vector<InputEvent> inputScript;
+size_t inputScriptPosition;
 
-	case 0xCD:
-		CMP(Absolute());
-		break;
+uint8_t ParseButtons(const std::string& text)
+{
+	static const char Letters[] = "ABsSUDLR";
+	uint8_t buttons = 0;
 
-	case 0xDD:
-		CMP(AbsoluteX());
-		break;
+	for (char c : text)
+	{
+		const char* letter = strchr(Letters, c);
 
-	case 0xD9:
-		CMP(AbsoluteY());
-		break;
+		if (letter && c)
+			buttons |= 1 << (letter - Letters);
+	}
 
-	case 0xC1:
-		CMP(IndirectX());
-		break;
+	return buttons;
+}
 
-	case 0xD1:
-		CMP(IndirectY());
-		break;
+bool LoadInputScript(const char* filename)
+{
+	ifstream file(filename);
 
-		// CPX
-	case 0xE0:
-		CPX(Immediate());
-		break;
+	if (!file)
+		return false;
 
-	case 0xE4:
-		CPX(ZeroPage());
-		break;
+	inputScript.clear();
+	inputScriptPosition = 0;
 
-	case 0xEC:
-		CPX(Absolute());
-		break;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
 
-		// CPY
-	case 0xC0:
-		CPY(Immediate());
-		break;
+		char pad1[16] = "";
+		char pad2[16] = "";
+		unsigned long long frame;
 
-	case 0xC4:
-		CPY(ZeroPage());
-		break;
+		if (sscanf(line.c_str(), "%llu %15s %15s", &frame, pad1, pad2) < 2)
+			continue;
 
-	case 0xCC:
-		CPY(Absolute());
-		break;
+		InputEvent event = { frame, { ParseButtons(pad1), ParseButtons(pad2) } };
+		inputScript.push_back(event);
+	}
 
-		// DEC (Decrement Memory)
-	case 0xC6:
-		DEC(ZeroPageAddress());
-		break;
+	return true;
+}
 
-	case 0xD6:
-		DEC(ZeroPageXAddress());
-		break;
+// Applies the script lines for the given frame, called before the frame runs
+void ApplyInputScript(uint64_t frame)
+{
+	while (inputScriptPosition < inputScript.size() && inputScript[inputScriptPosition].frame <= frame)
+	{
+		controllerButtons[0] = inputScript[inputScriptPosition].buttons[0];
+		controllerButtons[1] = inputScript[inputScriptPosition].buttons[1];
+		++inputScriptPosition;
+	}
+}
 
-	case 0xCE:
-		DEC(AbsoluteAddress());
-		break;
+// Movies
+// Binary input recordings for deterministic replay. A movie is tied to the ROM
+// it was recorded on and the power on state, so the same movie always drives
+// the same run. Layout, little endian:
+//   "NESM", version, power on RAM value, 2 reserved bytes
+//   8 byte hash of the ROM file
+//   4 byte frame count
+//   runs of (4 byte frame count, pad 1 buttons, pad 2 buttons)
 
-	case 0xDE:
-		DEC(AbsoluteXAddress());
-		break;
+const uint8_t MovieVersion = 1;
 
-		// DEX
-	case 0xCA:
-		Implicit();
-		DEX();
-		break;
+struct MovieRun
+{
+	uint32_t frames;
+	uint8_t buttons[2];
+};
 
-		// DEY
-	case 0x88:
-		Implicit();
-		DEY();
-		break;
-		// EOR
-	case 0x49:
-		EOR(Immediate());
-		break;
+const char* movieRecordFile;
+std::vector<MovieRun> movieRuns;
+uint64_t movieFrames;
 
-	case 0x45:
-		EOR(ZeroPage());
-		break;
+void WriteLE(ofstream& file, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+	{
+		file.put(static_cast<char>(value >> (i * 8)));
+	}
+}
 
-	case 0x55:
-		EOR(ZeroPageX());
-		break;
+uint64_t ReadLE(const uint8_t* data, int bytes)
+{
+	uint64_t value = 0;
 
-	case 0x4D:
-		EOR(Absolute());
-		break;
+	for (int i = 0; i < bytes; ++i)
+	{
+		value |= static_cast<uint64_t>(data[i]) << (i * 8);
+	}
 
-	case 0x5D:
-		EOR(AbsoluteX());
-		break;
+	return value;
+}
 
-	case 0x59:
-		EOR(AbsoluteY());
-		break;
+void StartMovieRecording(const char* filename)
+{
+	movieRecordFile = filename;
+	movieRuns.clear();
+	movieFrames = 0;
+}
 
-	case 0x41:
-		EOR(IndirectX());
-		break;
+// Records the buttons held for the frame about to run
+void RecordMovieFrame()
+{
+	if (!movieRecordFile)
+		return;
 
-	case 0x51:
-		EOR(IndirectY());
-		break;
+	if (!movieRuns.empty() && movieRuns.back().buttons[0] == controllerButtons[0] &&
+		movieRuns.back().buttons[1] == controllerButtons[1] && movieRuns.back().frames != UINT32_MAX)
+	{
+		++movieRuns.back().frames;
+	}
+	else
+	{
+		MovieRun run = { 1, { controllerButtons[0], controllerButtons[1] } };
+		movieRuns.push_back(run);
+	}
 
-		// INC
-	case 0xE6:
-		INC(ZeroPageAddress());
-		break;
+	++movieFrames;
+}
 
-	case 0xF6:
-		INC(ZeroPageXAddress());
-		break;
+bool SaveMovie()
+{
+	if (!movieRecordFile)
+		return true;
 
-	case 0xEE:
-		INC(AbsoluteAddress());
-		break;
+	// The frame that was running when emulation stopped never finished
+	if (movieFrames > frameCount)
+	{
+		if (--movieRuns.back().frames == 0)
+			movieRuns.pop_back();
 
-	case 0xFE:
-		INC(AbsoluteXAddress());
-		break;
+		--movieFrames;
+	}
 
-		// INX
-	case 0xE8:
-		Implicit();
+	ofstream file(movieRecordFile, std::ios::binary | std::ios::trunc);
+
+	if (!file)
+		return false;
+
+	file.write("NESM", 4);
+	file.put(MovieVersion);
+	file.put(powerOnRamValue);
+	WriteLE(file, 0, 2);
+	WriteLE(file, romHash, 8);
+	WriteLE(file, movieFrames, 4);
+
+	for (const MovieRun& run : movieRuns)
+	{
+		WriteLE(file, run.frames, 4);
+		file.put(run.buttons[0]);
+		file.put(run.buttons[1]);
+	}
+
+	movieRecordFile = nullptr;
+	return static_cast<bool>(file);
+}
+
+bool IsMovieFile(const char* filename)
+{
+	ifstream file(filename, std::ios::binary);
+	char magic[4] = {};
+	file.read(magic, sizeof(magic));
+
+	return file && memcmp(magic, "NESM", 4) == 0;
+}
+
+// Turns a movie into input script events. Call after LoadROM, playback
+// restarts the machine with the movie's power on state.
+bool LoadMovie(const char* filename)
+{
+	ifstream file(filename, std::ios::binary);
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	if (data.size() < 20 || memcmp(data.data(), "NESM", 4) != 0 || data[4] != MovieVersion)
+	{
+		cout << filename << " is not a movie" << endl;
+		return false;
+	}
+
+	if (ReadLE(&data[8], 8) != romHash)
+	{
+		cout << filename << " was recorded with a different ROM" << endl;
+		return false;
+	}
+
+	powerOnRamValue = data[5];
+	memset(RAM, powerOnRamValue, sizeof(RAM));
+
+	uint64_t frames = ReadLE(&data[16], 4);
+	uint64_t frame = 1;
+
+	inputScript.clear();
+	inputScriptPosition = 0;
+
+	for (size_t offset = 20; offset + 6 <= data.size() && frame <= frames; offset += 6)
+	{
+		InputEvent event = { frame, { data[offset + 4], data[offset + 5] } };
+		inputScript.push_back(event);
+		frame += ReadLE(&data[offset], 4);
+	}
+
+	// Nothing is held once the movie ends
+	InputEvent end = { frames + 1, { 0, 0 } };
+	inputScript.push_back(end);
+
+	return true;
+}
+
+// Loads either input format
+bool LoadInput(const char* filename)
+{
+	if (IsMovieFile(filename))
+		return LoadMovie(filename);
+
+	return LoadInputScript(filename);
+}
+
+// Memory is mapped in 256 byte pages. Pages backed by plain memory are read and
+// written directly, a null entry sends the access to the slow path which
+// handles registers and anything else with side effects.
+uint8_t* readPages[256];
+uint8_t* writePages[256];
+
+// The memory backing each page, readPages/writePages match these unless the page is trapped
+uint8_t* memoryReadPages[256];
+uint8_t* memoryWritePages[256];
+
+// Trapped pages go through the slow path even when they are backed by memory,
+// so watching an address costs nothing for accesses to any other page
+const uint8_t TRAP_READ = 0x01;
+const uint8_t TRAP_WRITE = 0x02;
+const uint8_t TRAP_CODE = 0x04; // Holds cached instructions, writes invalidate them
+uint8_t pageTraps[256];
+
+void UpdatePages()
+{
+	for (int page = 0; page < 256; ++page)
+	{
+		readPages[page] = (pageTraps[page] & TRAP_READ) ? nullptr : memoryReadPages[page];
+		writePages[page] = (pageTraps[page] & (TRAP_WRITE | TRAP_CODE)) ? nullptr : memoryWritePages[page];
+	}
+}
+
+void ResetDecodeCache();
+void InvalidateCode(uint16_t address);
+
+void MapMemory()
+{
+	// 2k internal ram (valid range 0x0 to 0x07FF)
+	// Values over 0x07FF wrap back to 0 (are mirrored)
+	for (int page = 0x00; page < 0x20; ++page)
+	{
+		memoryReadPages[page] = RAM + ((page & 0x07) << 8);
+		memoryWritePages[page] = memoryReadPages[page];
+	}
+
+	for (int page = 0x20; page < 0x60; ++page)
+	{
+		memoryReadPages[page] = nullptr;
+		memoryWritePages[page] = nullptr;
+	}
+
+	for (int page = 0x60; page < 0x80; ++page)
+	{
+		memoryReadPages[page] = SaveWorkRAM + ((page - 0x60) << 8);
+		memoryWritePages[page] = memoryReadPages[page];
+	}
+
+	// ROM is read only, writes go to the slow path and are dropped
+	for (int page = 0x80; page < 0x100; ++page)
+	{
+		memoryReadPages[page] = ROM + (((page - 0x80) << 8) & (prgSize - 1));
+		memoryWritePages[page] = nullptr;
+	}
+
+	UpdatePages();
+	ResetDecodeCache();
+}
+
+void TraceWriteTrap(uint16_t address, uint8_t value);
+void CheckMemoryConditions(uint16_t address, uint8_t value);
+void CheckWatchpoints(uint16_t address, uint8_t value, uint8_t access);
+
+void ReadTrap(uint16_t address, uint8_t value)
+{
+	CheckWatchpoints(address, value, TRAP_READ);
+}
+
+void WriteTrap(uint16_t address, uint8_t value)
+{
+	TraceWriteTrap(address, value);
+	CheckMemoryConditions(address, value);
+	CheckWatchpoints(address, value, TRAP_WRITE);
+}
+
+uint8_t ReadMemorySlow(uint16_t address)
+{
+	uint8_t page = address >> 8;
+	uint8_t value = 0;
+
+	if (memoryReadPages[page])
+	{
+		// Trapped page backed by memory
+		value = memoryReadPages[page][address & 0xFF];
+	}
+	else if (address >= 0x2000 && address < 0x4000)
+	{
+		// Mirror 0x2000 to 0x2007
+		value = ReadPPURegister(address);
+	}
+	else if (address == 0x4015)
+	{
+		value = ReadAPUStatus();
+	}
+	else if (address == 0x4016 || address == 0x4017)
+	{
+		value = ReadController(address & 0x01);
+	}
+
+	if (pageTraps[page] & TRAP_READ)
+		ReadTrap(address, value);
+
+	return value;
+}
+
+uint8_t ReadMemory(uint16_t address)
+{
+	uint8_t* page = readPages[address >> 8];
+
+	if (page)
+	{
+		return page[address & 0xFF];
+	}
+
+	return ReadMemorySlow(address);
+}
+
+// OAM DMA copies a whole page into sprite memory starting at OAMADDR ($2003)
+void OAMDMA(uint8_t high)
+{
+	uint8_t* source = readPages[high];
+	uint8_t oamAddress = PPU[3];
+
+	if (source)
+	{
+		memcpy(OAM + oamAddress, source, 256 - oamAddress);
+		memcpy(OAM, source + 256 - oamAddress, oamAddress);
+	}
+	else
+	{
+		for (int i = 0; i < 256; ++i)
+		{
+			OAM[(oamAddress + i) & 0xFF] = ReadMemorySlow((high << 8) | i);
+		}
+	}
+
+	// The CPU is halted for 513 cycles, plus one to align when the write lands on an odd cycle
+	cycles += 513 + (cycles & 1);
+}
+
+void WriteMemorySlow(uint16_t address, uint8_t value)
+{
+	uint8_t page = address >> 8;
+
+	if (pageTraps[page] & (TRAP_WRITE | TRAP_CODE))
+	{
+		if (pageTraps[page] & TRAP_WRITE)
+			WriteTrap(address, value);
+
+		if (pageTraps[page] & TRAP_CODE)
+			InvalidateCode(address);
+
+		if (memoryWritePages[page])
+		{
+			memoryWritePages[page][address & 0xFF] = value;
+			return;
+		}
+	}
+
+	if (address >= 0x2000 && address < 0x4000)
+	{
+		// Mirror 0x2000 to 0x2007
+		WritePPURegister(address, value);
+	}
+	else if (address == 0x4014)
+	{
+		OAMDMA(value);
+	}
+	else if (address == 0x4016)
+	{
+		WriteControllerStrobe(value);
+	}
+	else if (address >= 0x4000 && address <= 0x4017)
+	{
+		WriteAPU(address, value);
+	}
+}
+
+void WriteMemory(uint16_t address, uint8_t value)
+{
+	uint8_t* page = writePages[address >> 8];
+
+	if (page)
+	{
+		page[address & 0xFF] = value;
+		return;
+	}
+
+	WriteMemorySlow(address, value);
+}
+
+// Decode cache
+// Instructions are decoded once into their opcode and operand bytes and executed
+// from the cache after that. PRG ROM, internal RAM and work RAM are cached.
+// Code in RAM can be overwritten, so a page holding cached instructions is
+// trapped and a bitmap marks which of its bytes they came from. A write to one
+// of those bytes drops just the instructions covering it, writes to data on the
+// page only pay for the bitmap test and pages without code stay on the fast path.
+
+struct DecodedInstruction
+{
+	uint8_t opcode;
+	uint8_t operands[2];
+	uint8_t valid;
+};
+
+DecodedInstruction decodeCache[0x10000];
+bool decodePages[256]; // Pages that may be cached
+uint64_t decodeMisses; // Instructions decoded into the cache
+
+// Internal RAM is indexed by its address below $0800 so mirrors share bits
+uint8_t codeBytes[0x10000 / 8]; // Bytes of cached instructions on writable pages
+uint16_t codePageBytes[256]; // Cached instruction bytes on each writable page
+uint64_t codeWriteHits; // Writes that changed cached code
+uint64_t codeInvalidations; // Cached instructions dropped by them
+uint8_t* testCodeMemory; // The CPU tests' flat 64k, cached like RAM while they run
+
+bool IsCodeMemory(uint8_t* memory)
+{
+	return (memory >= ROM && memory < ROM + PrgWindowSize) || (memory >= RAM && memory < RAM + sizeof(RAM)) ||
+		(memory >= SaveWorkRAM && memory < SaveWorkRAM + SaveWorkRAMSize) ||
+		(testCodeMemory && memory >= testCodeMemory && memory < testCodeMemory + 0x10000);
+}
+
+void ResetDecodeCache()
+{
+	memset(decodeCache, 0, sizeof(decodeCache));
+	memset(codeBytes, 0, sizeof(codeBytes));
+	memset(codePageBytes, 0, sizeof(codePageBytes));
+
+	for (int page = 0; page < 256; ++page)
+	{
+		decodePages[page] = IsCodeMemory(memoryReadPages[page]);
+		pageTraps[page] &= ~TRAP_CODE;
+	}
+
+	UpdatePages();
+}
+
+uint16_t CodeAddress(uint16_t address)
+{
+	return address < 0x2000 ? address & 0x07FF : address;
+}
+
+// Traps or releases every page that maps to the same code page
+void SetCodeTrap(uint8_t codePage, bool trapped)
+{
+	int mirrors = codePage < 0x08 ? 4 : 1;
+
+	for (int i = 0; i < mirrors; ++i)
+	{
+		uint8_t page = codePage + i * 0x08;
+
+		if (trapped)
+			pageTraps[page] |= TRAP_CODE;
+		else
+			pageTraps[page] &= ~TRAP_CODE;
+	}
+
+	UpdatePages();
+}
+
+void TrackCode(uint16_t address, int length, bool add)
+{
+	for (int i = 0; i < length; ++i)
+	{
+		uint16_t code = CodeAddress(address + i);
+		uint8_t codePage = code >> 8;
+
+		if (add)
+		{
+			codeBytes[code >> 3] |= 1 << (code & 0x07);
+
+			if (codePageBytes[codePage]++ == 0)
+				SetCodeTrap(codePage, true);
+		}
+		else if (--codePageBytes[codePage] == 0)
+		{
+			// Bits stay set while other instructions may share them, the page is clean now
+			memset(codeBytes + (codePage << 5), 0, 32);
+			SetCodeTrap(codePage, false);
+		}
+	}
+}
+
+// Called for writes to code pages
+void InvalidateCode(uint16_t address)
+{
+	uint16_t code = CodeAddress(address);
+
+	if (!(codeBytes[code >> 3] & (1 << (code & 0x07))))
+		return;
+
+	uint64_t dropped = codeInvalidations;
+	int mirrors = code < 0x0800 ? 4 : 1;
+
+	// Every instruction covering the byte starts at most 2 bytes before it
+	for (int i = 0; i < mirrors; ++i)
+	{
+		uint16_t mirror = code + i * 0x0800;
+
+		for (int back = 0; back < 3; ++back)
+		{
+			uint16_t start = mirror - back;
+			DecodedInstruction& cached = decodeCache[start];
+			int length = InstructionLength(cached.opcode);
+
+			if (cached.valid && length > back && memoryWritePages[start >> 8])
+			{
+				cached.valid = 0;
+				TrackCode(start, length, false);
+				++codeInvalidations;
+			}
+		}
+	}
+
+	if (codeInvalidations != dropped)
+		++codeWriteHits;
+}
+
+// Drops every cached instruction on writable pages, for when their memory is replaced wholesale
+void ForgetWritableCode()
+{
+	for (int page = 0; page < 256; ++page)
+	{
+		if (memoryWritePages[page] && codePageBytes[CodeAddress(page << 8) >> 8])
+			memset(decodeCache + (page << 8), 0, 256 * sizeof(DecodedInstruction));
+	}
+
+	for (int codePage = 0; codePage < 256; ++codePage)
+	{
+		if (codePageBytes[codePage])
+		{
+			codePageBytes[codePage] = 0;
+			memset(codeBytes + (codePage << 5), 0, 32);
+			SetCodeTrap(codePage, false);
+		}
+	}
+}
+
+void DecodeInstruction(uint16_t address, DecodedInstruction& decoded)
+{
+	decoded.opcode = ReadMemory(address);
+
+	int length = InstructionLength(decoded.opcode);
+	decoded.operands[0] = length > 1 ? ReadMemory(address + 1) : 0;
+	decoded.operands[1] = length > 2 ? ReadMemory(address + 2) : 0;
+}
+
+const DecodedInstruction& FetchInstruction(uint16_t address)
+{
+	DecodedInstruction& cached = decodeCache[address];
+
+	if (cached.valid)
+		return cached;
+
+	if (!decodePages[address >> 8] || !decodePages[static_cast<uint16_t>(address + 2) >> 8])
+	{
+		static DecodedInstruction uncached;
+		DecodeInstruction(address, uncached);
+		return uncached;
+	}
+
+	DecodeInstruction(address, cached);
+	cached.valid = 1;
+	++decodeMisses;
+
+	if (memoryWritePages[address >> 8])
+		TrackCode(address, InstructionLength(cached.opcode), true);
+
+	return cached;
+}
+
+// Code analysis
+// At load time the code reachable from the vectors is found by following
+// branches, jumps and calls through PRG ROM. Every instruction found is decoded
+// into the cache before the first one runs, and the code map and basic blocks
+// say which bytes are code, which is what the code invalidation and
+// disassembly build on. Indirect jumps and jump tables can't be followed, so
+// code only reached through them is decoded on first execution as before.
+
+const uint8_t CODE_START = 0x01; // First byte of an instruction
+const uint8_t CODE_OPERAND = 0x02; // Operand byte of an instruction
+const uint8_t CODE_LEADER = 0x04; // First instruction of a basic block
+
+struct BasicBlock
+{
+	uint16_t start;
+	uint32_t end; // One past the last byte
+};
+
+uint8_t codeMap[PrgWindowSize]; // Indexed by PRG offset so the mirrors of a 16k cart share it
+std::vector<BasicBlock> basicBlocks;
+uint32_t codeInstructions;
+
+uint16_t PrgOffset(uint16_t address)
+{
+	return (address - 0x8000) & (prgSize - 1);
+}
+
+bool IsROMPage(uint8_t page)
+{
+	return decodePages[page] && !memoryWritePages[page];
+}
+
+bool EndsBlock(uint8_t opcode)
+{
+	uint8_t mode = opcodeModes[opcode];
+
+	return mode == RELATIVE || opcode == 0x4C || opcode == 0x6C || opcode == 0x7C || opcode == 0x20 ||
+		opcode == 0x60 || opcode == 0x40 || opcode == 0x00;
+}
+
+void AnalyzeCode()
+{
+	std::vector<uint16_t> pending;
+
+	memset(codeMap, 0, sizeof(codeMap));
+	basicBlocks.clear();
+	codeInstructions = 0;
+
+	for (uint16_t vector = 0xFFFA; vector != 0; vector += 2)
+	{
+		pending.push_back(ReadMemory(vector) | (ReadMemory(vector + 1) << 8));
+	}
+
+	while (!pending.empty())
+	{
+		uint16_t address = pending.back();
+		pending.pop_back();
+
+		if (IsROMPage(address >> 8))
+			codeMap[PrgOffset(address)] |= CODE_LEADER;
+
+		for (;;)
+		{
+			// Stop at code already seen, outside ROM and at anything that isn't an instruction
+			if (!IsROMPage(address >> 8) || (codeMap[PrgOffset(address)] & (CODE_START | CODE_OPERAND)))
+				break;
+
+			const DecodedInstruction& decoded = FetchInstruction(address);
+			uint8_t opcode = decoded.opcode;
+			int length = InstructionLength(opcode);
+
+			if (opcodeNames[opcode][0] == '?' || static_cast<uint32_t>(address) + length > 0x10000)
+				break;
+
+			codeMap[PrgOffset(address)] |= CODE_START;
+			++codeInstructions;
+
+			for (int i = 1; i < length; ++i)
+			{
+				codeMap[PrgOffset(address + i)] |= CODE_OPERAND;
+			}
+
+			uint16_t next = address + length;
+			uint16_t target = decoded.operands[0] | (decoded.operands[1] << 8);
+
+			if (opcodeModes[opcode] == RELATIVE)
+				target = static_cast<uint16_t>(next + static_cast<int8_t>(decoded.operands[0]));
+
+			if (opcodeModes[opcode] == RELATIVE || opcode == 0x20 || opcode == 0x4C)
+				pending.push_back(target);
+
+			// Unconditional transfers don't fall through, calls are assumed to return
+			if (opcode == 0x4C || opcode == 0x6C || opcode == 0x60 || opcode == 0x40 || opcode == 0x00 ||
+				opcode == 0x80 || opcode == 0x7C)
+				break;
+
+			if (EndsBlock(opcode) && IsROMPage(next >> 8))
+				codeMap[PrgOffset(next)] |= CODE_LEADER;
+
+			address = next;
+		}
+	}
+
+	// Blocks run from a leader up to the instruction that ends them or the next leader.
+	// They are given in the window the disassembler sweeps, code found in a mirror included.
+	BasicBlock block = { 0, 0 };
+	bool open = false;
+
+	for (uint32_t address = 0x10000 - prgSize; address < 0x10000; ++address)
+	{
+		uint8_t flags = codeMap[PrgOffset(address)];
+
+		if (!(flags & CODE_START))
+			continue;
+
+		if (open && ((flags & CODE_LEADER) || block.end != address))
+		{
+			basicBlocks.push_back(block);
+			open = false;
+		}
+
+		if (!open)
+		{
+			block.start = address;
+			open = true;
+		}
+
+		uint8_t opcode = ROM[PrgOffset(address)];
+		block.end = address + InstructionLength(opcode);
+
+		if (EndsBlock(opcode))
+		{
+			basicBlocks.push_back(block);
+			open = false;
+		}
+	}
+
+	if (open)
+		basicBlocks.push_back(block);
+}
+
+void PrintCodeAnalysis()
+{
+	uint32_t codeBytes = 0;
+
+	for (const BasicBlock& block : basicBlocks)
+	{
+		codeBytes += block.end - block.start;
+	}
+
+	cout << codeInstructions << " instructions in " << basicBlocks.size() << " blocks, " << codeBytes << " of " << prgSize << " PRG bytes are code" << endl;
+
+	char line[32];
+
+	for (const BasicBlock& block : basicBlocks)
+	{
+		sprintf(line, "$%04X-$%04X", block.start, static_cast<unsigned>(block.end - 1));
+		cout << line << endl;
+	}
+}
+
+uint8_t PullStack()
+{
+	++SP;
+	return ReadMemory(0x100 + SP);
+}
+
+void PushStack(uint8_t value)
+{
+	WriteMemory(0x100 + SP, value);
+	--SP;
+}
+
+// Addressing Modes
+
+uint8_t Accumulator()
+{
+    return A;
+}
+
+uint8_t Immediate()
+{
+	return operands[0];
+}
+
+uint16_t ZeroPageAddress()
+{
+	return operands[0];
+}
+
+uint8_t ZeroPage()
+{
+    return ReadMemory(ZeroPageAddress());
+}
+
+uint16_t ZeroPageXAddress()
+{
+	// Zero page indexing wraps within the zero page
+	return static_cast<uint8_t>(operands[0] + X);
+}
+
+uint8_t ZeroPageX()
+{
+    return ReadMemory(ZeroPageXAddress());
+}
+
+uint16_t ZeroPageYAddress()
+{
+	return static_cast<uint8_t>(operands[0] + Y);
+}
+
+uint8_t ZeroPageY()
+{
+	return ReadMemory(ZeroPageYAddress());
+}
+
+uint8_t Relative()
+{
+	return operands[0];
+}
+
+uint16_t AbsoluteAddress()
+{
+	return operands[0] | (operands[1] << 8);
+}
+
+uint8_t Absolute()
+{
+    return ReadMemory(AbsoluteAddress());
+}
+
+uint16_t AbsoluteXAddress()
+{
+	uint16_t address = operands[0] | (operands[1] << 8);
+
+	// Indexing past 0xFFFF wraps to the bottom of memory
+	return static_cast<uint16_t>(address + X);
+}
+
+// Indexed reads take an extra cycle when the index carries into the high byte
+void PageCrossed(uint16_t address, uint8_t index)
+{
+	if (((address - index) ^ address) & 0xFF00)
+	{
+		++cycles;
+	}
+}
+
+uint8_t AbsoluteX()
+{
+	uint16_t address = AbsoluteXAddress();
+	PageCrossed(address, X);
+
+    return ReadMemory(address);
+}
+
+uint16_t AbsoluteYAddress()
+{
+	uint16_t address = operands[0] | (operands[1] << 8);
+
+	return static_cast<uint16_t>(address + Y);
+}
+
+uint8_t AbsoluteY()
+{
+	uint16_t address = AbsoluteYAddress();
+	PageCrossed(address, Y);
+
+	return ReadMemory(address);
+}
+
+template <typename Variant>
+uint16_t IndirectAddress()
+{
+	uint16_t address = operands[0] | (operands[1] << 8);
+	uint8_t low = ReadMemory(address);
+	uint8_t high;
+
+	// If the address is on a page boundary 0x??FF then it changes to 0x??00 for the high byte
+	// Example 0x02FF becomes 0x0200, the 65C02 fixed this
+	if (!Variant::CMOS && (address & 0xFF) == 0xFF)
+	{
+		high = ReadMemory(address & 0xFF00);
+	}
+	else
+	{
+		high = ReadMemory(address + 1);
+	}
+
+    return (low | (high << 8));
+}
+
+uint16_t IndirectXAddress()
+{
+	// The pointer and its high byte both wrap within the zero page
+	uint8_t pointer = static_cast<uint8_t>(operands[0] + X);
+	uint8_t low = ReadMemory(pointer);
+	uint8_t high = ReadMemory(static_cast<uint8_t>(pointer + 1));
+
+	return low | (high << 8);
+}
+
+uint8_t IndirectX()
+{
+    return ReadMemory(IndirectXAddress());
+}
+
+uint16_t IndirectYAddress()
+{
+	uint8_t low = ReadMemory(operands[0]);
+	uint8_t high = ReadMemory(static_cast<uint8_t>(operands[0] + 1));
+
+	return static_cast<uint16_t>((low | (high << 8)) + Y);
+}
+
+uint8_t IndirectY()
+{  
+	uint16_t address = IndirectYAddress();
+	PageCrossed(address, Y);
+
+    return ReadMemory(address);
+}
+
+// 65C02 (zp) mode, indirect Y without the index
+uint16_t ZeroPageIndirectAddress()
+{
+	uint8_t low = ReadMemory(operands[0]);
+	uint8_t high = ReadMemory(static_cast<uint8_t>(operands[0] + 1));
+
+	return low | (high << 8);
+}
+
+uint8_t ZeroPageIndirect()
+{
+	return ReadMemory(ZeroPageIndirectAddress());
+}
+
+// 65C02 JMP (abs,X)
+uint16_t AbsoluteIndexedIndirectAddress()
+{
+	uint16_t address = static_cast<uint16_t>((operands[0] | (operands[1] << 8)) + X);
+
+	return ReadMemory(address) | (ReadMemory(static_cast<uint16_t>(address + 1)) << 8);
+}
+
+// Taken branches cost an extra cycle, plus another when the target is on a different page
+void Branch(uint8_t value)
+{
+	uint16_t target = PC + static_cast<int8_t>(value);
+
+	cycles += ((PC ^ target) & 0xFF00) ? 2 : 1;
+
+	PC = target;
+}
+
+template <typename Variant> void SBC(uint8_t value);
+
+// BCD addition, the NMOS part takes Z from the binary sum and N and V from the sum
+// before the high digit is adjusted, the 65C02 spends a cycle fixing N and Z
+template <typename Variant>
+void AddDecimal(uint8_t value)
+{
+	uint8_t carry = C;
+	int low = (A & 0x0F) + (value & 0x0F) + carry;
+
+	if (low >= 0x0A)
+		low = ((low + 0x06) & 0x0F) + 0x10;
+
+	int result = (A & 0xF0) + (value & 0xF0) + low;
+	int sign = static_cast<int8_t>(A & 0xF0) + static_cast<int8_t>(value & 0xF0) + low;
+
+	// Zero flag from the binary sum
+	Z = ((A + value + carry) & 0xFF) == 0 ? 1 : 0;
+
+	// Overflow and negative flags
+	V = (sign < -128 || sign > 127) ? 1 : 0;
+	N = (result >> 7) & 0x1;
+
+	if (result >= 0xA0)
+		result += 0x60;
+
+	// Carry flag
+	C = result >= 0x100 ? 1 : 0;
+
+	A = result & 0xFF;
+
+	if (Variant::CMOS)
+	{
+		Z = A == 0 ? 1 : 0;
+		N = (A >> 7) & 0x1;
+		++cycles;
+	}
+}
+
+// BCD subtraction, the NMOS part keeps all flags from the binary difference
+template <typename Variant>
+void SubtractDecimal(uint8_t value)
+{
+	int low = (A & 0x0F) - (value & 0x0F) + C - 1;
+	int result;
+
+	if (Variant::CMOS)
+	{
+		result = A - value + C - 1;
+
+		if (result < 0)
+			result -= 0x60;
+
+		if (low < 0)
+			result -= 0x06;
+	}
+	else
+	{
+		if (low < 0)
+			low = ((low - 0x06) & 0x0F) - 0x10;
+
+		result = (A & 0xF0) - (value & 0xF0) + low;
+
+		if (result < 0)
+			result -= 0x60;
+	}
+
+	// Carry, overflow, zero and negative flags from the binary difference
+	SBC<Ricoh2A03>(value);
+
+	A = result & 0xFF;
+
+	if (Variant::CMOS)
+	{
+		Z = A == 0 ? 1 : 0;
+		N = (A >> 7) & 0x1;
+		++cycles;
+	}
+}
+
+// ADC (Add with carry)
+template <typename Variant>
+void ADC(uint8_t value)
+{
+	if (Variant::Decimal && D)
+	{
+		AddDecimal<Variant>(value);
+		return;
+	}
+
+    uint16_t result = A + value + C;
+    
+    // Carry flag
+    C = (result & 0x100) >> 8;
+    
+    // Overflow flag
+    V = (((A ^ result) & (value ^ result) & 0x80) >> 7) & 0x01;
+    
+    A = result & 0xFF;
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+// AND (Logical AND)
+void AND(uint8_t value)
+{
+    A &= value;
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (A >> 7) & 0x1;
+}
+
+// Arithmetic Shift Left
+void ASL_A()
+{
+	// Carry flag
+	C = ((A & 0x80) >> 7) & 0x01;
+
+	A = A << 1;
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+void ASL(uint16_t address)
+{
+	uint8_t value = ReadMemory(address);
+
+	// Carry flag
+	C = ((value & 0x80) >> 7) & 0x01;
+
+    value = value << 1;
+    
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+
+	WriteMemory(address, value);
+}
+
+// Branch if Carry Clear
+void BCC(uint8_t value)
+{
+    if (!C)
+    {
+        Branch(value);
+    }
+}
+
+// Branch if Carry Set
+void BCS(uint8_t value)
+{
+    if (C)
+    {
+        Branch(value);
+    }
+}
+
+// Branch if Equal
+void BEQ(uint8_t value)
+{
+    if(Z)
+    {
+        Branch(value);
+    }
+}
+
+// Bit Test
+void BIT(uint8_t value)
+{
+    uint8_t result = A & value;
+    
+    // Zero flag
+    Z = result == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+    
+    // Overflow flag
+    V = (value >> 6) & 0x1;
+}
+
+void BMI(uint8_t value)
+{
+    if (N)
+    {
+        Branch(value);
+    }
+}
+
+void BNE(uint8_t value)
+{
+    if(!Z)
+    {
+        Branch(value);
+    }
+}
+
+void BPL(uint8_t value)
+{
+    if (!N)
+    {
+        Branch(value);
+    }
+}
+
+template <typename Variant>
+void BRK()
+{
+	// The byte after BRK is padding, the return address skips over it
+	uint16_t address = PC + 1;
+	uint8_t low = address & 0xFF;
+	uint8_t high = (address >> 8) & 0xFF;
+
+	PushStack(high);
+	PushStack(low);
+
+	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (V << 6) | (N << 7);
+	P |= (1 << 4);
+	P |= (1 << 5);
+
+	PushStack(P);
+
+	I = 1;
+
+	// The 65C02 leaves decimal mode on any interrupt
+	if (Variant::CMOS)
+		D = 0;
+
+	PC = ReadMemory(0xFFFE) | (ReadMemory(0xFFFF) << 8);
+}
+
+void BVC(uint8_t value)
+{
+    if(!V)
+    {
+        Branch(value);
+    }
+}
+
+void BVS(uint8_t value)
+{
+    if (V)
+    {
+        Branch(value);
+    }
+}
+
+void CLC()
+{
+    C = 0;
+}
+
+void CLD()
+{
+    D = 0;
+}
+
+void CLI()
+{
+    I = 0;
+}
+
+void CLV()
+{
+    V = 0;
+}
+
+void CMP(uint8_t value)
+{
+    // Carry flag
+    C = A >= value;
+    
+    // Zero flag
+    Z = A == value;
+    
+    uint8_t result = A - value;
+    
+    // Negative flag
+    N = (result >> 7) & 0x1;
+}
+
+void CPX(uint8_t value)
+{
+    // Carry flag
+    C = X >= value;
+    
+    // Zero flag
+    Z = X == value;
+    
+    uint8_t result = X - value;
+    
+    // Negative flag
+    N = (result >> 7) & 0x1;
+}
+
+void CPY(uint8_t value)
+{
+    // Carry flag
+    C = Y >= value;
+    
+    // Zero flag
+    Z = Y == value;
+    
+    uint8_t result = Y - value;
+    
+    // Negative flag
+    N = (result >> 7) & 0x1;
+}
+
+void DEC(uint16_t address)
+{
+    uint8_t value = ReadMemory(address);
+    value -= 1;
+    
+    WriteMemory(address, value);
+    
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+}
+
+void DEX()
+{
+    X -= 1;
+    
+    // Zero flag
+    Z = X == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (X >> 7) & 0x1;
+}
+
+void DEY()
+{
+    Y -= 1;
+    
+    // Zero flag
+    Z = Y == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (Y >> 7) & 0x1;
+}
+
+void EOR(uint8_t value)
+{
+    A = A ^ value;
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (A >> 7) & 0x1;
+}
+
+void INC(uint16_t address)
+{
+    uint8_t value = ReadMemory(address);
+    value += 1;
+    WriteMemory(address, value);
+    
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+}
+
+void INX()
+{
+    X += 1;
+    
+    // Zero flag
+    Z = X == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (X >> 7) & 0x1;
+}
+
+void INY()
+{
+    Y += 1;
+    
+    // Zero flag
+    Z = Y == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (Y >> 7) & 0x1;
+}
+
+void JMP(uint16_t address)
+{
+    PC = address;
+}
+
+// JSR (Jump To Subroutine
+void JSR(uint16_t address)
+{
+    uint16_t temp = PC - 1;
+    uint8_t low = temp & 0xFF;
+    uint8_t high = (temp >> 8) & 0xFF;
+    
+	PushStack(high);
+	PushStack(low);
+	
+    PC = address;
+}
+
+void LDA(uint8_t value)
+{
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+    
+    A = value;
+}
+
+void LDX(uint8_t value)
+{
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+    
+    X = value;
+}
+
+void LDY(uint8_t value)
+{
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (value >> 7) & 0x1;
+    
+    Y = value;
+}
+
+void LSR_A()
+{
+    // Carry flag
+    C = A & 0x01;
+    
+    // Bit 7 is set to 0 after the shift
+    A = (A >> 1) & 0x7F;
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = 0;
+}
+
+void LSR(uint16_t address)
+{
+    uint8_t value = ReadMemory(address);
+    
+    // Carry flag
+    C = value & 0x01;
+    
+    // Bit 7 is set to 0 after the shift
+    value = (value >> 1) & 0x7F;
+    
+    // Zero flag
+    Z = value == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = 0;
+
+	WriteMemory(address, value);
+}
+
+void NOP()
+{
+}
+
+void ORA(uint8_t value)
+{
+    A = A | value;
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (A >> 7) & 0x1;
+}
+
+void PHA()
+{
+	PushStack(A);
+}
+
+void PHP()
+{
+    uint8_t P = C | ( Z << 1) | ( I << 2) | (D << 3) | (V << 6) | (N << 7);
+    P |= (1 << 4);
+    P |= (1 << 5);
+    
+	PushStack(P);
+}
+
+void PLA()
+{
+	A = PullStack();
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (A >> 7) & 0x1;
+}
+
+void PLP()
+{
+	uint8_t P = PullStack();
+
+	C = P & 0x01;
+	Z = (P >> 1) & 0x01;
+	I = (P >> 2) & 0x01;
+	D = (P >> 3) & 0x01;
+	V = (P >> 6) & 0x01;
+	N = (P >> 7) & 0x01;
+}
+
+void ROL_A()
+{
+	uint8_t newBitZero = C;
+
+	// Carry flag becomes the old bit 7
+	C = (A >> 7) & 0x01;
+
+	A = (A << 1);
+
+	// The first bit should be 0 now due to the bit shift.
+	A |= newBitZero;
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+void ROL(uint16_t address)
+{
+	uint8_t value = ReadMemory(address);
+
+	uint8_t newBitZero = C;
+
+	// Carry flag becomes the old bit 7
+	C = (value >> 7) & 0x01;
+
+	value = value << 1;
+
+	// The first bit should be 0 now due to the bit shift.
+	value |= newBitZero;
+
+	// Zero flag
+	Z = value == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (value >> 7) & 0x1;
+
+	WriteMemory(address, value);
+}
+
+void ROR_A()
+{
+	uint8_t newLastBit = C;
+
+	// Carry flag becomes the old bit 7
+	C = A & 0x01;
+
+	A = (A >> 1) & 0x7F;
+
+	// The last bit should be 0 due to masking with 0x7F.
+	A |= (newLastBit << 7);
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+void ROR(uint16_t address)
+{
+	uint8_t value = ReadMemory(address);
+
+	uint8_t newLastBit = C;
+
+	// Carry flag becomes the old bit 7
+	C = value & 0x01;
+
+	value = (value >> 1) & 0x7F;
+
+	// The last bit should be 0 due to masking with 0x7F.
+	value |= (newLastBit << 7);
+
+	// Zero flag
+	Z = value == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (value >> 7) & 0x1;
+
+	WriteMemory(address, value);
+}
+
+void RTI()
+{
+	uint8_t P = PullStack();
+	C = P & 0x01;
+	Z = (P >> 1) & 0x01;
+	I = (P >> 2) & 0x01;
+	D = (P >> 3) & 0x01;
+	V = (P >> 6) & 0x01;
+	N = (P >> 7) & 0x01;
+
+	uint8_t low = PullStack();
+	uint8_t high = PullStack();
+	
+	PC = low | (high << 8);
+}
+
+void RTS()
+{
+	uint8_t low = PullStack();
+	uint8_t high = PullStack();
+	
+	uint16_t address = low | (high << 8);
+	PC = address + 1;
+}
+
+template <typename Variant>
+void SBC(uint8_t value)
+{
+	if (Variant::Decimal && D)
+	{
+		SubtractDecimal<Variant>(value);
+		return;
+	}
+
+	value = value ^ 0xFF;
+
+	uint16_t result = A + value + C;
+
+	// Carry flag
+	C = (result & 0x100) >> 8;
+
+	// Overflow flag
+	V = (((A ^ result) & (value ^ result) & 0x80) >> 7) & 0x01;
+
+	A = result & 0xFF;
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+void SEC()
+{
+	C = 1;
+}
+
+void SED()
+{
+	D = 1;
+}
+
+void SEI()
+{
+	I = 1;
+}
+
+void STA(uint16_t address)
+{
+	WriteMemory(address, A);
+}
+
+void STX(uint16_t address)
+{
+	WriteMemory(address, X);
+}
+
+void STY(uint16_t address)
+{
+	WriteMemory(address, Y);
+}
+
+void TAX()
+{
+    X = A;
+    
+    // Zero flag
+    Z = X == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (X >> 7) & 0x1;
+}
+
+void TAY()
+{
+    Y = A;
+    
+    // Zero flag
+    Z = Y == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (Y >> 7) & 0x1;
+}
+
+void TSX()
+{
+    X = SP;
+    
+    // Zero flag
+    Z = X == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (X >> 7) & 0x1;
+}
+
+// TXA (Transfer X to Accumulator)
+void TXA()
+{
+    A = X;
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (A >> 7) & 0x1;
+}
+
+// TXS (Transfer X to Stack Pointer)
+void TXS()
+{
+    SP = X;
+}
+
+// TYA (Transfer Y to Accumulator)
+void TYA()
+{
+    A = Y;
+    
+    // Zero flag
+    Z = A == 0 ? 1 : 0;
+    
+    // Negative flag
+    N = (A >> 7) & 0x1;
+}
+
+// 65C02 instructions
+
+// BIT immediate only sets the Zero flag
+void BIT_Immediate(uint8_t value)
+{
+	Z = (A & value) == 0 ? 1 : 0;
+}
+
+void INC_A()
+{
+	A += 1;
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+void DEC_A()
+{
+	A -= 1;
+
+	// Zero flag
+	Z = A == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (A >> 7) & 0x1;
+}
+
+void PHX()
+{
+	PushStack(X);
+}
+
+void PHY()
+{
+	PushStack(Y);
+}
+
+void PLX()
+{
+	X = PullStack();
+
+	// Zero flag
+	Z = X == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (X >> 7) & 0x1;
+}
+
+void PLY()
+{
+	Y = PullStack();
+
+	// Zero flag
+	Z = Y == 0 ? 1 : 0;
+
+	// Negative flag
+	N = (Y >> 7) & 0x1;
+}
+
+// STZ (Store Zero)
+void STZ(uint16_t address)
+{
+	WriteMemory(address, 0);
+}
+
+// TRB (Test and Reset Bits)
+void TRB(uint16_t address)
+{
+	uint8_t value = ReadMemory(address);
+
+	// Zero flag
+	Z = (A & value) == 0 ? 1 : 0;
+
+	WriteMemory(address, value & ~A);
+}
+
+// TSB (Test and Set Bits)
+void TSB(uint16_t address)
+{
+	uint8_t value = ReadMemory(address);
+
+	// Zero flag
+	Z = (A & value) == 0 ? 1 : 0;
+
+	WriteMemory(address, value | A);
+}
+
+// Maskable interrupt, taken between instructions while the I flag is clear
+template <typename Variant>
+void IRQ()
+{
+	PushStack((PC >> 8) & 0xFF);
+	PushStack(PC & 0xFF);
+
+	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (V << 6) | (N << 7);
+	P |= (1 << 5);
+
+	PushStack(P);
+
+	I = 1;
+
+	// The 65C02 leaves decimal mode on any interrupt
+	if (Variant::CMOS)
+		D = 0;
+
+	PC = ReadMemory(0xFFFE) | (ReadMemory(0xFFFF) << 8);
+	cycles += 7;
+}
+
+// Non maskable interrupt, raised by the PPU at the start of vertical blank
+template <typename Variant>
+void NMI()
+{
+	PushStack((PC >> 8) & 0xFF);
+	PushStack(PC & 0xFF);
+
+	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (V << 6) | (N << 7);
+	P |= (1 << 5);
+
+	PushStack(P);
+
+	I = 1;
+
+	// The 65C02 leaves decimal mode on any interrupt
+	if (Variant::CMOS)
+		D = 0;
+
+	PC = ReadMemory(0xFFFA) | (ReadMemory(0xFFFB) << 8);
+	cycles += 7;
+	nmiPending = false;
+}
+
+// Base cycle count for each opcode, page crossing and branch penalties are added by the addressing modes
+const uint8_t OpcodeCycles[256] =
+{
+	7, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 4, 4, 6, 6,
+	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+	6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 4, 4, 6, 6,
+	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+	6, 6, 2, 8, 3, 3, 5, 5, 3, 2, 2, 2, 3, 4, 6, 6,
+	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+	6, 6, 2, 8, 3, 3, 5, 5, 4, 2, 2, 2, 5, 4, 6, 6,
+	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+	2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+	2, 6, 2, 6, 4, 4, 4, 4, 2, 5, 2, 5, 5, 5, 5, 5,
+	2, 6, 2, 6, 3, 3, 3, 3, 2, 2, 2, 2, 4, 4, 4, 4,
+	2, 5, 2, 5, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4,
+	2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7,
+	2, 6, 2, 8, 3, 3, 5, 5, 2, 2, 2, 2, 4, 4, 6, 6,
+	2, 5, 2, 8, 4, 4, 6, 6, 2, 4, 2, 7, 4, 4, 7, 7
+};
+
+// One instance per CPU variant, the variant flags fold away at compile time
+template <typename Variant>
+void ExecuteInstruction()
+{
+	logAddress = PC;
+
+	// Operands are fetched with the opcode, the addressing modes read them from operands[]
+	const DecodedInstruction& decoded = FetchInstruction(PC);
+	uint8_t opcode = decoded.opcode;
+
+	operands[0] = decoded.operands[0];
+	operands[1] = decoded.operands[1];
+	PC += InstructionLength(opcode);
+
+	logOpcode = opcode;
+	cycles += Variant::CMOS ? CmosOpcodeCycles[opcode] : OpcodeCycles[opcode];
+
+	switch (opcode)
+	{
+
+		// ADC (Add with carry)
+	case 0x69:
+		ADC<Variant>(Immediate());
+		break;
+
+	case 0x65:
+		ADC<Variant>(ZeroPage());
+		break;
+
+	case 0x75:
+		ADC<Variant>(ZeroPageX());
+		break;
+
+	case 0x6D:
+		ADC<Variant>(Absolute());
+		break;
+
+	case 0x7D:
+		ADC<Variant>(AbsoluteX());
+		break;
+
+	case 0x79:
+		ADC<Variant>(AbsoluteY());
+		break;
+
+	case 0x61:
+		ADC<Variant>(IndirectX());
+		break;
+
+	case 0x71:
+		ADC<Variant>(IndirectY());
+		break;
+
+		// AND
+	case 0x29:
+		AND(Immediate());
+		break;
+
+	case 0x25:
+		AND(ZeroPage());
+		break;
+
+	case 0x35:
+		AND(ZeroPageX());
+		break;
+
+	case 0x2D:
+		AND(Absolute());
+		break;
+
+	case 0x3D:
+		AND(AbsoluteX());
+		break;
+
+	case 0x39:
+		AND(AbsoluteY());
+		break;
+
+	case 0x21:
+		AND(IndirectX());
+		break;
+
+	case 0x31:
+		AND(IndirectY());
+		break;
+
+		// ASL (Arithmetic Shift Left)
+	case 0x0A:
+		Accumulator();
+		ASL_A();
+		break;
+
+	case 0x06:
+		ASL(ZeroPageAddress());
+		break;
+
+	case 0x16:
+		ASL(ZeroPageXAddress());
+		break;
+
+	case 0x0E:
+		ASL(AbsoluteAddress());
+		break;
+
+	case 0x1E:
+		ASL(AbsoluteXAddress());
+		break;
+
+		// BCC (Branch if Carry Clear)
+	case 0x90:
+		BCC(Relative());
+		break;
+
+		// BCS (Branch if Carry Set)
+	case 0xB0:
+		BCS(Relative());
+		break;
+
+		// BEQ (Branch if Equal)
+	case 0xF0:
+		BEQ(Relative());
+		break;
+
+		// BIT (Bit Test)
+	case 0x24:
+		BIT(ZeroPage());
+		break;
+
+	case 0x2C:
+		BIT(Absolute());
+		break;
+
+		// BMI (Branch if Minus)
+	case 0x30:
+		BMI(Relative());
+		break;
+
+		// BNE (Branch if Not Equal)
+	case 0xD0:
+		BNE(Relative());
+		break;
+
+		// BPL (Branch if Positive)
+	case 0x10:
+		BPL(Relative());
+		break;
+
+		// BRK (Force Interrupt)
+	case 0x00:
+		BRK<Variant>();
+		break;
+
+		// BVC (Branch if Overflow Clear)
+	case 0x50:
+		BVC(Relative());
+		break;
+
+		// BVS (Branch if Overflow Set)
+	case 0x70:
+		BVS(Relative());
+		break;
+
+		// CLC (Clear Carry Flag)
+	case 0x18:
+		CLC();
+		break;
+
+		// CLD (Clear Decimal Mode)
+	case 0xD8:
+		CLD();
+		break;
+
+		// CLI (Clear Interrupt Disable)
+	case 0x58:
+		CLI();
+		break;
+
+		// CLV (Clear Overflow Flag)
+	case 0xB8:
+		CLV();
+		break;
+
+		// CMP (Compare)
+	case 0xC9:
+		CMP(Immediate());
+		break;
+
+	case 0xC5:
+		CMP(ZeroPage());
+		break;
+
+	case 0xD5:
+		CMP(ZeroPageX());
+		break;
+
+	case 0xCD:
+		CMP(Absolute());
+		break;
+
+	case 0xDD:
+		CMP(AbsoluteX());
+		break;
+
+	case 0xD9:
+		CMP(AbsoluteY());
+		break;
+
+	case 0xC1:
+		CMP(IndirectX());
+		break;
+
+	case 0xD1:
+		CMP(IndirectY());
+		break;
+
+		// CPX
+	case 0xE0:
+		CPX(Immediate());
+		break;
+
+	case 0xE4:
+		CPX(ZeroPage());
+		break;
+
+	case 0xEC:
+		CPX(Absolute());
+		break;
+
+		// CPY
+	case 0xC0:
+		CPY(Immediate());
+		break;
+
+	case 0xC4:
+		CPY(ZeroPage());
+		break;
+
+	case 0xCC:
+		CPY(Absolute());
+		break;
+
+		// DEC (Decrement Memory)
+	case 0xC6:
+		DEC(ZeroPageAddress());
+		break;
+
+	case 0xD6:
+		DEC(ZeroPageXAddress());
+		break;
+
+	case 0xCE:
+		DEC(AbsoluteAddress());
+		break;
+
+	case 0xDE:
+		DEC(AbsoluteXAddress());
+		break;
+
+		// DEX
+	case 0xCA:
+		DEX();
+		break;
+
+		// DEY
+	case 0x88:
+		DEY();
+		break;
+		// EOR
+	case 0x49:
+		EOR(Immediate());
+		break;
+
+	case 0x45:
+		EOR(ZeroPage());
+		break;
+
+	case 0x55:
+		EOR(ZeroPageX());
+		break;
+
+	case 0x4D:
+		EOR(Absolute());
+		break;
+
+	case 0x5D:
+		EOR(AbsoluteX());
+		break;
+
+	case 0x59:
+		EOR(AbsoluteY());
+		break;
+
+	case 0x41:
+		EOR(IndirectX());
+		break;
+
+	case 0x51:
+		EOR(IndirectY());
+		break;
+
+		// INC
+	case 0xE6:
+		INC(ZeroPageAddress());
+		break;
+
+	case 0xF6:
+		INC(ZeroPageXAddress());
+		break;
+
+	case 0xEE:
+		INC(AbsoluteAddress());
+		break;
+
+	case 0xFE:
+		INC(AbsoluteXAddress());
+		break;
+
+		// INX
+	case 0xE8:
 		INX();
 		break;
 
-		// INY
-	case 0xC8:
-		Implicit();
-		INY();
-		break;
+		// INY
+	case 0xC8:
+		INY();
+		break;
+
+		// JMP
+	case 0x4C:
+		JMP(AbsoluteAddress());
+		break;
+
+	case 0x6C:
+		JMP(IndirectAddress<Variant>());
+		break;
+
+		// JSR
+	case 0x20:
+		JSR(AbsoluteAddress());
+		break;
+
+		// LDA
+	case 0xA9:
+		LDA(Immediate());
+		break;
+	case 0xA5:
+		LDA(ZeroPage());
+		break;
+	case 0xB5:
+		LDA(ZeroPageX());
+		break;
+	case 0xAD:
+		LDA(Absolute());
+		break;
+	case 0xBD:
+		LDA(AbsoluteX());
+		break;
+	case 0xB9:
+		LDA(AbsoluteY());
+		break;
+	case 0xA1:
+		LDA(IndirectX());
+		break;
+	case 0xB1:
+		LDA(IndirectY());
+		break;
+
+		// LDX
+	case 0xA2:
+		LDX(Immediate());
+		break;
+	case 0xA6:
+		LDX(ZeroPage());
+		break;
+	case 0xB6:
+		LDX(ZeroPageY());
+		break;
+	case 0xAE:
+		LDX(Absolute());
+		break;
+	case 0xBE:
+		LDX(AbsoluteY());
+		break;
+
+		// LDY
+	case 0xA0:
+		LDY(Immediate());
+		break;
+	case 0xA4:
+		LDY(ZeroPage());
+		break;
+	case 0xB4:
+		LDY(ZeroPageX());
+		break;
+	case 0xAC:
+		LDY(Absolute());
+		break;
+	case 0xBC:
+		LDY(AbsoluteX());
+		break;
+
+		// LSR
+	case 0x4A:
+		LSR_A();
+		break;
+	case 0x46:
+		LSR(ZeroPageAddress());
+		break;
+	case 0x56:
+		LSR(ZeroPageXAddress());
+		break;
+	case 0x4E:
+		LSR(AbsoluteAddress());
+		break;
+	case 0x5E:
+		LSR(AbsoluteXAddress());
+		break;
+
+		// NOP
+	case 0xEA:
+		NOP();
+		break;
+
+		// ORA
+	case 0x09:
+		ORA(Immediate());
+		break;
+	case 0x05:
+		ORA(ZeroPage());
+		break;
+	case 0x15:
+		ORA(ZeroPageX());
+		break;
+	case 0x0D:
+		ORA(Absolute());
+		break;
+	case 0x1D:
+		ORA(AbsoluteX());
+		break;
+	case 0x19:
+		ORA(AbsoluteY());
+		break;
+	case 0x01:
+		ORA(IndirectX());
+		break;
+	case 0x11:
+		ORA(IndirectY());
+		break;
+
+		// PHA
+	case 0x48:
+		PHA();
+		break;
+
+		// PHP
+	case 0x08:
+		PHP();
+		break;
+
+		// PLA
+	case 0x68:
+		PLA();
+		break;
+
+		// PLP
+	case 0x28:
+		PLP();
+		break;
+
+		// ROL
+	case 0x2A:
+		Accumulator();
+		ROL_A();
+		break;
+
+	case 0x26:
+		ROL(ZeroPageAddress());
+		break;
+
+	case 0x36:
+		ROL(ZeroPageXAddress());
+		break;
+
+	case 0x2E:
+		ROL(AbsoluteAddress());
+		break;
+
+	case 0x3E:
+		ROL(AbsoluteXAddress());
+		break;
+
+		// ROR
+	case 0x6A:
+		Accumulator();
+		ROR_A();
+		break;
+
+	case 0x66:
+		ROR(ZeroPageAddress());
+		break;
+
+	case 0x76:
+		ROR(ZeroPageXAddress());
+		break;
+
+	case 0x6E:
+		ROR(AbsoluteAddress());
+		break;
+
+	case 0x7E:
+		ROR(AbsoluteXAddress());
+		break;
+
+		// RTI
+	case 0x40:
+		RTI();
+		break;
+
+		// RTS
+	case 0x60:
+		RTS();
+		break;
+
+		// SBC
+	case 0xE9:
+		SBC<Variant>(Immediate());
+		break;
+	case 0xE5:
+		SBC<Variant>(ZeroPage());
+		break;
+	case 0xF5:
+		SBC<Variant>(ZeroPageX());
+		break;
+	case 0xED:
+		SBC<Variant>(Absolute());
+		break;
+	case 0xFD:
+		SBC<Variant>(AbsoluteX());
+		break;
+	case 0xF9:
+		SBC<Variant>(AbsoluteY());
+		break;
+	case 0xE1:
+		SBC<Variant>(IndirectX());
+		break;
+	case 0xF1:
+		SBC<Variant>(IndirectY());
+		break;
+
+		// SEC
+	case 0x38:
+		SEC();
+		break;
+
+		// SED
+	case 0xF8:
+		SED();
+		break;
+
+		// SEI
+	case 0x78:
+		SEI();
+		break;
+
+		// STA
+	case 0x85:
+		STA(ZeroPageAddress());
+		break;
+	case 0x95:
+		STA(ZeroPageXAddress());
+		break;
+	case 0x8D:
+		STA(AbsoluteAddress());
+		break;
+	case 0x9D:
+		STA(AbsoluteXAddress());
+		break;
+	case 0x99:
+		STA(AbsoluteYAddress());
+		break;
+	case 0x81:
+		STA(IndirectXAddress());
+		break;
+	case 0x91:
+		STA(IndirectYAddress());
+		break;
+
+		// STX
+	case 0x86:
+		STX(ZeroPageAddress());
+		break;
+	case 0x96:
+		STX(ZeroPageYAddress());
+		break;
+	case 0x8E:
+		STX(AbsoluteAddress());
+		break;
+
+		// STY
+	case 0x84:
+		STY(ZeroPageAddress());
+		break;
+	case 0x94:
+		STY(ZeroPageXAddress());
+		break;
+	case 0x8C:
+		STY(AbsoluteAddress());
+		break;
+
+		// TAX
+	case 0xAA:
+		TAX();
+		break;
+
+		// TAY
+	case 0xA8:
+		TAY();
+		break;
+
+		// TSX
+	case 0xBA:
+		TSX();
+		break;
+
+		// TXA
+	case 0x8A:
+		TXA();
+		break;
+
+		// TXS
+	case 0x9A:
+		TXS();
+		break;
+
+		// TYA (Transfer Y to Accumulator)
+	case 0x98:
+		TYA();
+		break;
+
+		// 65C02 additions, the other variants treat these opcodes as before
+	case 0x80:
+		if (Variant::CMOS)
+			Branch(Relative());
+		break;
+
+	case 0x12:
+		if (Variant::CMOS)
+			ORA(ZeroPageIndirect());
+		break;
+
+	case 0x32:
+		if (Variant::CMOS)
+			AND(ZeroPageIndirect());
+		break;
+
+	case 0x52:
+		if (Variant::CMOS)
+			EOR(ZeroPageIndirect());
+		break;
+
+	case 0x72:
+		if (Variant::CMOS)
+			ADC<Variant>(ZeroPageIndirect());
+		break;
+
+	case 0x92:
+		if (Variant::CMOS)
+			STA(ZeroPageIndirectAddress());
+		break;
+
+	case 0xB2:
+		if (Variant::CMOS)
+			LDA(ZeroPageIndirect());
+		break;
+
+	case 0xD2:
+		if (Variant::CMOS)
+			CMP(ZeroPageIndirect());
+		break;
+
+	case 0xF2:
+		if (Variant::CMOS)
+			SBC<Variant>(ZeroPageIndirect());
+		break;
+
+	case 0x89:
+		if (Variant::CMOS)
+			BIT_Immediate(Immediate());
+		break;
+
+	case 0x34:
+		if (Variant::CMOS)
+			BIT(ZeroPageX());
+		break;
+
+	case 0x3C:
+		if (Variant::CMOS)
+			BIT(AbsoluteX());
+		break;
+
+	case 0x1A:
+		if (Variant::CMOS)
+			INC_A();
+		break;
+
+	case 0x3A:
+		if (Variant::CMOS)
+			DEC_A();
+		break;
+
+	case 0xDA:
+		if (Variant::CMOS)
+			PHX();
+		break;
+
+	case 0x5A:
+		if (Variant::CMOS)
+			PHY();
+		break;
+
+	case 0xFA:
+		if (Variant::CMOS)
+			PLX();
+		break;
+
+	case 0x7A:
+		if (Variant::CMOS)
+			PLY();
+		break;
+
+	case 0x64:
+		if (Variant::CMOS)
+			STZ(ZeroPageAddress());
+		break;
+
+	case 0x74:
+		if (Variant::CMOS)
+			STZ(ZeroPageXAddress());
+		break;
+
+	case 0x9C:
+		if (Variant::CMOS)
+			STZ(AbsoluteAddress());
+		break;
+
+	case 0x9E:
+		if (Variant::CMOS)
+			STZ(AbsoluteXAddress());
+		break;
+
+	case 0x04:
+		if (Variant::CMOS)
+			TSB(ZeroPageAddress());
+		break;
+
+	case 0x0C:
+		if (Variant::CMOS)
+			TSB(AbsoluteAddress());
+		break;
+
+	case 0x14:
+		if (Variant::CMOS)
+			TRB(ZeroPageAddress());
+		break;
+
+	case 0x1C:
+		if (Variant::CMOS)
+			TRB(AbsoluteAddress());
+		break;
+
+	case 0x7C:
+		if (Variant::CMOS)
+			JMP(AbsoluteIndexedIndirectAddress());
+		break;
+
+	default:
+		break;
+	}
+}
+
+// Dispatch for the selected variant, the 2A03 unless -cpu says otherwise
+void (*ProcessInstruction)() = ExecuteInstruction<Ricoh2A03>;
+void (*ProcessIRQ)() = IRQ<Ricoh2A03>;
+void (*ProcessNMI)() = NMI<Ricoh2A03>;
+
+// Selects the CPU variant by name, returns false for an unknown one
+bool SelectCpu(const string& name)
+{
+	if (name == "2a03")
+	{
+		ProcessInstruction = ExecuteInstruction<Ricoh2A03>;
+		ProcessIRQ = IRQ<Ricoh2A03>;
+		ProcessNMI = NMI<Ricoh2A03>;
+		opcodeNames = OpcodeNames;
+		opcodeModes = OpcodeModes;
+		return true;
+	}
+
+	if (name == "6502")
+	{
+		ProcessInstruction = ExecuteInstruction<NMOS6502>;
+		ProcessIRQ = IRQ<NMOS6502>;
+		ProcessNMI = NMI<NMOS6502>;
+		opcodeNames = OpcodeNames;
+		opcodeModes = OpcodeModes;
+		return true;
+	}
+
+	if (name != "65c02")
+		return false;
+
+	// The 65C02 tables start from the NMOS ones, its undefined opcodes stay one byte NOPs
+	for (int i = 0; i < 256; ++i)
+	{
+		CmosOpcodeNames[i] = OpcodeNames[i];
+		CmosOpcodeModes[i] = OpcodeModes[i];
+		CmosOpcodeCycles[i] = OpcodeCycles[i];
+	}
+
+	for (const CmosOpcode& entry : CmosOpcodes)
+	{
+		CmosOpcodeNames[entry.opcode] = entry.name;
+		CmosOpcodeModes[entry.opcode] = entry.mode;
+		CmosOpcodeCycles[entry.opcode] = entry.cycles;
+	}
+
+	ProcessInstruction = ExecuteInstruction<WDC65C02>;
+	ProcessIRQ = IRQ<WDC65C02>;
+	ProcessNMI = NMI<WDC65C02>;
+	opcodeNames = CmosOpcodeNames;
+	opcodeModes = CmosOpcodeModes;
+	return true;
+}
+
+// Disassembler
+// Table driven, so instructions can be disassembled from any bytes: a ROM image,
+// memory, or a binary trace record long after it was executed. Operands that
+// address a location with a symbol are written as the symbol.
+
+std::vector<std::string> symbols; // Indexed by address, empty until a symbol file is loaded
+
+// Longer symbol names are cut so formatted lines fit in fixed buffers. The longest
+// trace line is "xxxx MNE (symbol),Y", " A xx, X xx, Y xx, SP xx P: NVUBDIZC CYC: ",
+// a 20 digit cycle and the newline, plus the terminator
+const size_t MaxSymbolLength = 32;
+const size_t MaxTraceLine = 10 + MaxSymbolLength + 3 + 42 + 20 + 2;
+
+// The writer thread formats by hand, sprintf is several times slower and
+// would make the writer the bottleneck
+char* WriteHex(char* out, uint8_t value)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	out[0] = digits[value >> 4];
+	out[1] = digits[value & 0x0F];
+
+	return out + 2;
+}
+
+char* WriteText(char* out, const char* text)
+{
+	while (*text)
+		*out++ = *text++;
+
+	return out;
+}
+
+const char* SymbolAt(uint16_t address)
+{
+	if (symbols.empty() || symbols[address].empty())
+		return nullptr;
+
+	return symbols[address].c_str();
+}
+
+// Writes a symbol if there is one, otherwise $xx or $xxxx
+char* WriteAddress(char* out, uint16_t address, bool zeroPage)
+{
+	const char* symbol = SymbolAt(address);
+
+	if (symbol)
+		return WriteText(out, symbol);
+
+	*out++ = '$';
+
+	if (!zeroPage)
+		out = WriteHex(out, address >> 8);
+
+	return WriteHex(out, address & 0xFF);
+}
+
+char* WriteOperand(char* out, uint16_t pc, uint8_t opcode, const uint8_t* operands)
+{
+	uint16_t address = operands[0] | (operands[1] << 8);
+
+	switch (opcodeModes[opcode])
+	{
+		case ACCUMULATOR:
+			*out++ = 'A';
+			break;
+		case IMMEDIATE:
+			out = WriteHex(WriteText(out, "#$"), operands[0]);
+			break;
+		case ZEROPAGE:
+			out = WriteAddress(out, operands[0], true);
+			break;
+		case ZEROPAGEX:
+			out = WriteText(WriteAddress(out, operands[0], true), ",X");
+			break;
+		case ZEROPAGEY:
+			out = WriteText(WriteAddress(out, operands[0], true), ",Y");
+			break;
+		case RELATIVE:
+			out = WriteAddress(out, static_cast<uint16_t>(pc + 2 + static_cast<int8_t>(operands[0])), false);
+			break;
+		case ABSOLUTE:
+			out = WriteAddress(out, address, false);
+			break;
+		case ABSOLUTEX:
+			out = WriteText(WriteAddress(out, address, false), ",X");
+			break;
+		case ABSOLUTEY:
+			out = WriteText(WriteAddress(out, address, false), ",Y");
+			break;
+		case INDIRECT:
+			out = WriteText(WriteAddress(WriteText(out, "("), address, false), ")");
+			break;
+		case INDIRECTX:
+			out = WriteText(WriteAddress(WriteText(out, "("), operands[0], true), ",X)");
+			break;
+		case INDIRECTY:
+			out = WriteText(WriteAddress(WriteText(out, "("), operands[0], true), "),Y");
+			break;
+		case ZEROPAGEINDIRECT:
+			out = WriteText(WriteAddress(WriteText(out, "("), operands[0], true), ")");
+			break;
+		case ABSOLUTEINDEXEDINDIRECT:
+			out = WriteText(WriteAddress(WriteText(out, "("), address, false), ",X)");
+			break;
+		default:
+			break;
+	}
+
+	return out;
+}
+
+// Writes "MNEMONIC operand" for the instruction at pc
+char* WriteInstruction(char* out, uint16_t pc, uint8_t opcode, const uint8_t* operands)
+{
+	out = WriteText(out, opcodeNames[opcode]);
+
+	if (opcodeModes[opcode] != IMPLICIT)
+	{
+		*out++ = ' ';
+		out = WriteOperand(out, pc, opcode, operands);
+	}
+
+	return out;
+}
+
+void AddSymbol(uint16_t address, const std::string& name)
+{
+	if (symbols.empty())
+		symbols.resize(0x10000);
+
+	// Keep the first name given to an address
+	if (symbols[address].empty())
+		symbols[address] = name.substr(0, MaxSymbolLength);
+}
+
+// FCEUX .nl files, one "$C000#name#comment" per line
+void LoadNlSymbols(ifstream& file)
+{
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		size_t first = line.find('#');
+		size_t second = line.find('#', first + 1);
+
+		if (line.empty() || line[0] != '$' || first == std::string::npos)
+			continue;
+
+		std::string name = line.substr(first + 1, second == std::string::npos ? std::string::npos : second - first - 1);
+
+		if (!name.empty())
+			AddSymbol(static_cast<uint16_t>(strtoul(line.c_str() + 1, nullptr, 16)), name);
+	}
+}
+
+// ca65 debug files, symbols are "sym" lines with name="..." and val=0x... fields
+void LoadDbgSymbols(ifstream& file)
+{
+	std::string line;
+
+	while (std::getline(file, line))
+	{
+		if (line.compare(0, 4, "sym\t") != 0)
+			continue;
+
+		size_t name = line.find("name=\"");
+		size_t value = line.find("val=");
+
+		if (name == std::string::npos || value == std::string::npos)
+			continue;
+
+		name += 6;
+		size_t end = line.find('"', name);
+
+		AddSymbol(static_cast<uint16_t>(strtoul(line.c_str() + value + 4, nullptr, 0)), line.substr(name, end - name));
+	}
+}
+
+bool LoadSymbols(const char* filename)
+{
+	ifstream file(filename);
+
+	if (!file)
+		return false;
+
+	size_t length = strlen(filename);
+
+	if (length > 4 && strcmp(filename + length - 4, ".dbg") == 0)
+		LoadDbgSymbols(file);
+	else
+		LoadNlSymbols(file);
+
+	return true;
+}
+
+uint8_t PeekMemory(uint16_t address);
+
+// Linear sweep of the PRG ROM as mapped at $8000, labels on their own lines.
+// Once code analysis has found code, bytes it didn't reach are shown as data.
+void DisassembleROM(std::ostream& out)
+{
+	char line[MaxTraceLine];
+	uint32_t address = 0x10000 - prgSize;
+
+	while (address < 0x10000)
+	{
+		uint8_t opcode = PeekMemory(address);
+		int length = std::min<int>(InstructionLength(opcode), 0x10000 - address);
+
+		if (codeInstructions && !(codeMap[PrgOffset(address)] & CODE_START))
+		{
+			char* p = WriteHex(WriteHex(line, address >> 8), address & 0xFF);
+			p = WriteHex(WriteText(p, "  "), opcode);
+			p = WriteHex(WriteText(p, "        .byte $"), opcode);
+			*p = 0;
+
+			out << line << endl;
+			++address;
+			continue;
+		}
+		uint8_t operands[2] = { PeekMemory((address + 1) & 0xFFFF), PeekMemory((address + 2) & 0xFFFF) };
+		const char* symbol = SymbolAt(address);
+
+		if (symbol)
+			out << symbol << ":" << endl;
+
+		char* p = WriteHex(WriteHex(line, address >> 8), address & 0xFF);
+		p = WriteText(p, "  ");
+
+		for (int i = 0; i < 3; ++i)
+		{
+			if (i < length)
+				p = WriteText(WriteHex(p, i == 0 ? opcode : operands[i - 1]), " ");
+			else
+				p = WriteText(p, "   ");
+		}
+
+		p = WriteInstruction(WriteText(p, " "), address, opcode, operands);
+		*p = 0;
+
+		out << line << endl;
+		address += length;
+	}
+}
+
+// Trace
+// Each traced instruction is stored as a binary record in a single producer,
+// single consumer ring. A writer thread formats the records, optionally
+// compresses them and writes large blocks, so the emulation thread never
+// waits on the disk. If the ring fills up records are dropped and counted,
+// and a marker with the count goes into the trace where they are missing.
+// With -tracewait the emulation thread yields until the writer catches up
+// instead, so the trace is never lossy.
+
+struct TraceRecord
+{
+	uint64_t cycle;
+	uint16_t pc;
+	uint8_t opcode;
+	uint8_t operands[2];
+	uint8_t a, x, y, sp, p;
+};
+
+const uint32_t TraceRingSize = 1 << 16;
+const uint32_t TraceBlockSize = 1 << 20;
+
+TraceRecord traceRing[TraceRingSize];
+std::atomic<uint64_t> traceHead; // Next record the emulation thread fills
+std::atomic<uint64_t> traceTail; // Next record the writer thread reads
+std::atomic<bool> traceRunning;
+std::thread traceThread;
+ofstream tracefile;
+bool tracing;
+bool traceCompress;
+bool traceBinary; // Write packed records instead of text
+bool traceWait; // Wait for the writer when the ring is full instead of dropping
+uint64_t traceStalls; // Times the ring was full
+uint64_t traceDropped; // Records dropped because the ring was full
+uint64_t traceGap; // Dropped records not yet marked in the ring
+
+// LZ77 block compression, a byte oriented format in the spirit of LZ4.
+// Each sequence is a token (literal count << 4 | match length - 4), literal
+// count extension bytes, the literals, then a 16 bit match offset and match
+// length extension bytes. The last sequence has literals only.
+const int LZMinMatch = 4;
+const int LZHashBits = 14;
+
+size_t LZMaxCompressedSize(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+uint8_t* WriteLZLength(uint8_t* out, size_t length)
+{
+	while (length >= 255)
+	{
+		*out++ = 255;
+		length -= 255;
+	}
+
+	*out++ = static_cast<uint8_t>(length);
+	return out;
+}
+
+uint8_t* WriteLZSequence(uint8_t* out, const uint8_t* literals, size_t literalCount, size_t offset, size_t matchLength)
+{
+	uint8_t* token = out++;
+	*token = static_cast<uint8_t>((literalCount < 15 ? literalCount : 15) << 4);
+
+	if (literalCount >= 15)
+		out = WriteLZLength(out, literalCount - 15);
+
+	memcpy(out, literals, literalCount);
+	out += literalCount;
+
+	if (matchLength)
+	{
+		size_t length = matchLength - LZMinMatch;
+		*token |= length < 15 ? length : 15;
+
+		*out++ = offset & 0xFF;
+		*out++ = (offset >> 8) & 0xFF;
+
+		if (length >= 15)
+			out = WriteLZLength(out, length - 15);
+	}
+
+	return out;
+}
+
+size_t CompressLZ(const uint8_t* in, size_t size, uint8_t* out)
+{
+	static uint32_t table[1 << LZHashBits];
+	memset(table, 0, sizeof(table));
+
+	uint8_t* start = out;
+	size_t anchor = 0;
+	size_t position = 0;
+
+	while (position + LZMinMatch <= size)
+	{
+		uint32_t sequence;
+		memcpy(&sequence, in + position, 4);
+
+		uint32_t hash = (sequence * 2654435761u) >> (32 - LZHashBits);
+		size_t candidate = table[hash];
+		table[hash] = static_cast<uint32_t>(position);
+
+		if (candidate < position && position - candidate <= 0xFFFF && memcmp(in + candidate, in + position, 4) == 0)
+		{
+			size_t length = LZMinMatch;
+			while (position + length < size && in[candidate + length] == in[position + length])
+				++length;
+
+			out = WriteLZSequence(out, in + anchor, position - anchor, position - candidate, length);
+			position += length;
+			anchor = position;
+		}
+		else
+		{
+			++position;
+		}
+	}
+
+	out = WriteLZSequence(out, in + anchor, size - anchor, 0, 0);
+
+	return out - start;
+}
+
+// Returns the decompressed size, or 0 if the input is corrupt
+size_t DecompressLZ(const uint8_t* in, size_t size, uint8_t* out, size_t capacity)
+{
+	const uint8_t* end = in + size;
+	size_t written = 0;
+
+	while (in < end)
+	{
+		uint8_t token = *in++;
+		size_t literalCount = token >> 4;
+
+		if (literalCount == 15)
+		{
+			uint8_t extra;
+			do
+			{
+				if (in >= end)
+					return 0;
+				extra = *in++;
+				literalCount += extra;
+			} while (extra == 255);
+		}
+
+		if (literalCount > static_cast<size_t>(end - in) || written + literalCount > capacity)
+			return 0;
+
+		memcpy(out + written, in, literalCount);
+		in += literalCount;
+		written += literalCount;
+
+		// The last sequence ends after its literals
+		if (in == end)
+			break;
+
+		if (end - in < 2)
+			return 0;
+
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		size_t length = (token & 0x0F) + LZMinMatch;
+
+		if ((token & 0x0F) == 15)
+		{
+			uint8_t extra;
+			do
+			{
+				if (in >= end)
+					return 0;
+				extra = *in++;
+				length += extra;
+			} while (extra == 255);
+		}
+
+		if (offset == 0 || offset > written || written + length > capacity)
+			return 0;
+
+		// Matches can overlap their own output
+		for (size_t i = 0; i < length; ++i, ++written)
+		{
+			out[written] = out[written - offset];
+		}
+	}
+
+	return written;
+}
+
+// Binary traces start with "NTBN" and hold packed records in host byte order:
+// cycle (8 bytes), pc (2), opcode, 2 operand bytes, A, X, Y, SP, P
+// P always has bit 5 set, a record without it marks dropped records and
+// holds their count in the cycle
+const size_t PackedTraceRecordSize = 18;
+
+size_t PackTraceRecord(const TraceRecord& record, char* out)
+{
+	memcpy(out, &record.cycle, 8);
+	memcpy(out + 8, &record.pc, 2);
+	out[10] = record.opcode;
+	out[11] = record.operands[0];
+	out[12] = record.operands[1];
+	out[13] = record.a;
+	out[14] = record.x;
+	out[15] = record.y;
+	out[16] = record.sp;
+	out[17] = record.p;
+
+	return PackedTraceRecordSize;
+}
+
+void UnpackTraceRecord(const uint8_t* in, TraceRecord& record)
+{
+	memcpy(&record.cycle, in, 8);
+	memcpy(&record.pc, in + 8, 2);
+	record.opcode = in[10];
+	record.operands[0] = in[11];
+	record.operands[1] = in[12];
+	record.a = in[13];
+	record.x = in[14];
+	record.y = in[15];
+	record.sp = in[16];
+	record.p = in[17];
+}
+
+char* WriteDecimal(char* out, uint64_t value)
+{
+	char digits[24];
+	int count = 0;
+
+	do
+	{
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	while (count)
+		*out++ = digits[--count];
+
+	return out;
+}
+
+size_t FormatTraceRecord(const TraceRecord& record, char* out)
+{
+	char* start = out;
+	uint8_t P = record.p;
+
+	if (!(P & 0x20))
+	{
+		out = WriteText(WriteDecimal(WriteText(out, "-- "), record.cycle), " records dropped --\n");
+		return out - start;
+	}
+
+	out = WriteHex(out, record.pc >> 8);
+	out = WriteHex(out, record.pc & 0xFF);
+	*out++ = ' ';
+	out = WriteInstruction(out, record.pc, record.opcode, record.operands);
+	out = WriteHex(WriteText(out, " A "), record.a);
+	out = WriteHex(WriteText(out, ", X "), record.x);
+	out = WriteHex(WriteText(out, ", Y "), record.y);
+	out = WriteHex(WriteText(out, ", SP "), record.sp);
+	out = WriteText(out, " P: ");
+	*out++ = (P & 0x80) ? 'N' : 'n';
+	*out++ = (P & 0x40) ? 'V' : 'v';
+	*out++ = 'U';
+	*out++ = 'B';
+	*out++ = (P & 0x08) ? 'D' : 'd';
+	*out++ = (P & 0x04) ? 'I' : 'i';
+	*out++ = (P & 0x02) ? 'Z' : 'z';
+	*out++ = (P & 0x01) ? 'C' : 'c';
+	out = WriteDecimal(WriteText(out, " CYC: "), record.cycle);
+	*out++ = '\n';
+
+	return out - start;
+}
+
+void WriteTraceBlock(const char* block, size_t size, std::vector<uint8_t>& compressed)
+{
+	if (!traceCompress)
+	{
+		tracefile.write(block, size);
+		return;
+	}
+
+	compressed.resize(LZMaxCompressedSize(size));
+	uint32_t header[2] = { static_cast<uint32_t>(size), static_cast<uint32_t>(CompressLZ((const uint8_t*)block, size, compressed.data())) };
+
+	tracefile.write((char*)header, sizeof(header));
+	tracefile.write((char*)compressed.data(), header[1]);
+}
+
+void TraceWriterThread()
+{
+	std::vector<char> block(TraceBlockSize + MaxTraceLine);
+	std::vector<uint8_t> compressed;
+	size_t used = 0;
+
+	if (traceBinary)
+	{
+		memcpy(block.data(), "NTBN", 4);
+		used = 4;
+	}
+
+	for (;;)
+	{
+		// Load the running flag before the head so the final records are seen
+		bool running = traceRunning.load(std::memory_order_acquire);
+		uint64_t head = traceHead.load(std::memory_order_acquire);
+		uint64_t tail = traceTail.load(std::memory_order_relaxed);
+
+		if (tail == head)
+		{
+			if (!running)
+				break;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			continue;
+		}
+
+		for (; tail != head; ++tail)
+		{
+			const TraceRecord& record = traceRing[tail & (TraceRingSize - 1)];
+			used += traceBinary ? PackTraceRecord(record, block.data() + used) : FormatTraceRecord(record, block.data() + used);
+
+			if (used >= TraceBlockSize)
+			{
+				WriteTraceBlock(block.data(), used, compressed);
+				used = 0;
+			}
+		}
+
+		traceTail.store(tail, std::memory_order_release);
+	}
+
+	if (used)
+		WriteTraceBlock(block.data(), used, compressed);
+}
+
+void BeginTraceRecord(TraceRecord& record)
+{
+	// Registers are recorded as they were before the instruction
+	record.cycle = cycles;
+	record.pc = PC;
+	record.a = A;
+	record.x = X;
+	record.y = Y;
+	record.sp = SP;
+	record.p = C | (Z << 1) | (I << 2) | (D << 3) | (1 << 5) | (V << 6) | (N << 7);
+}
+
+void EndTraceRecord(TraceRecord& record)
+{
+	record.opcode = logOpcode;
+	record.operands[0] = operands[0];
+	record.operands[1] = operands[1];
+}
+
+// Puts the count of dropped records in the ring at head as a marker
+void MarkDroppedRecords(uint64_t& head)
+{
+	TraceRecord& marker = traceRing[head++ & (TraceRingSize - 1)];
+	marker = TraceRecord();
+	marker.cycle = traceGap;
+	traceGap = 0;
+}
+
+// Returns the ring slot for the next record, or null when the ring is full and the record is dropped.
+// A marker for earlier dropped records is put in first, which advances head.
+TraceRecord* NextTraceSlot(uint64_t& head)
+{
+	if (head - traceTail.load(std::memory_order_acquire) == TraceRingSize)
+	{
+		++traceStalls;
+
+		if (!traceWait)
+		{
+			++traceDropped;
+			++traceGap;
+			return nullptr;
+		}
+
+		while (head - traceTail.load(std::memory_order_acquire) == TraceRingSize)
+			std::this_thread::yield();
+	}
+
+	if (traceGap)
+	{
+		// The marker needs a slot of its own
+		if (head + 1 - traceTail.load(std::memory_order_acquire) == TraceRingSize)
+		{
+			++traceDropped;
+			++traceGap;
+			return nullptr;
+		}
+
+		MarkDroppedRecords(head);
+	}
+
+	return &traceRing[head & (TraceRingSize - 1)];
+}
+
+void PushTraceRecord(const TraceRecord& record)
+{
+	uint64_t head = traceHead.load(std::memory_order_relaxed);
+
+	if (TraceRecord* slot = NextTraceSlot(head))
+	{
+		*slot = record;
+		traceHead.store(head + 1, std::memory_order_release);
+	}
+}
+
+// Trace triggers
+// Capture can be limited to a window of PCs, started and stopped when the PC
+// reaches an address range or a watched address is written, started at a
+// frame number and limited to a number of instructions. While waiting for a
+// trigger instructions run at close to full speed: PC triggers cost one table
+// lookup and write triggers trap only the watched pages. With a flight
+// recorder the last K instructions are kept in memory and written out when
+// capture starts.
+
+enum TraceAction
+{
+	TRACE_START,
+	TRACE_STOP
+};
+
+struct TraceTrigger
+{
+	TraceAction action;
+	uint16_t low;
+	uint16_t high;
+	int value; // Write triggers only, -1 matches any value
+};
+
+std::vector<TraceTrigger> tracePcTriggers;
+std::vector<TraceTrigger> traceWriteTriggers;
+uint8_t tracePcPages[256]; // Pages that contain a PC trigger
+uint16_t traceWindowLow = 0x0000;
+uint16_t traceWindowHigh = 0xFFFF;
+uint64_t traceStartFrame; // 0 disables the frame trigger
+uint64_t traceLimit; // 0 captures until stopped
+uint64_t traceCaptured;
+bool traceCapturing;
+int tracePending = -1; // Action raised by a write during the current instruction
+
+std::vector<TraceRecord> traceHistory;
+size_t traceHistoryNext;
+size_t traceHistoryCount;
+
+void AddTracePcTrigger(TraceAction action, uint16_t low, uint16_t high)
+{
+	tracePcTriggers.push_back({ action, low, high, -1 });
+
+	for (int page = low >> 8; page <= high >> 8; ++page)
+	{
+		tracePcPages[page] = 1;
+	}
+}
+
+void AddTraceWriteTrigger(TraceAction action, uint16_t low, uint16_t high, int value)
+{
+	traceWriteTriggers.push_back({ action, low, high, value });
+
+	for (int page = low >> 8; page <= high >> 8; ++page)
+	{
+		pageTraps[page] |= TRAP_WRITE;
+	}
+
+	UpdatePages();
+}
+
+void SetTraceHistory(size_t count)
+{
+	traceHistory.resize(count);
+	traceHistoryNext = 0;
+	traceHistoryCount = 0;
+}
+
+void FlushTraceHistory()
+{
+	size_t size = traceHistory.size();
+	size_t index = (traceHistoryNext + size - traceHistoryCount) % size;
+
+	for (; traceHistoryCount > 0; --traceHistoryCount)
+	{
+		PushTraceRecord(traceHistory[index]);
+		index = (index + 1) % size;
+	}
+}
+
+void StartCapture()
+{
+	if (traceCapturing)
+		return;
+
+	if (!traceHistory.empty())
+		FlushTraceHistory();
+
+	traceCapturing = true;
+	traceCaptured = 0;
+}
+
+void StopCapture()
+{
+	traceCapturing = false;
+}
+
+void TraceWriteTrap(uint16_t address, uint8_t value)
+{
+	for (const TraceTrigger& trigger : traceWriteTriggers)
+	{
+		if (address >= trigger.low && address <= trigger.high && (trigger.value < 0 || trigger.value == value))
+			tracePending = trigger.action;
+	}
+}
+
+void CheckTracePcTriggers()
+{
+	for (const TraceTrigger& trigger : tracePcTriggers)
+	{
+		if (PC >= trigger.low && PC <= trigger.high)
+		{
+			if (trigger.action == TRACE_START)
+				StartCapture();
+			else
+				StopCapture();
+		}
+	}
+}
+
+void TraceFrame(uint64_t frame)
+{
+	if (traceStartFrame && frame == traceStartFrame)
+		StartCapture();
+}
+
+void TraceInstruction()
+{
+	uint64_t head = traceHead.load(std::memory_order_relaxed);
+	TraceRecord* record = NextTraceSlot(head);
+
+	if (!record)
+	{
+		ProcessInstruction();
+	}
+	else
+	{
+		BeginTraceRecord(*record);
+		ProcessInstruction();
+		EndTraceRecord(*record);
+
+		traceHead.store(head + 1, std::memory_order_release);
+	}
+
+	if (traceLimit && ++traceCaptured >= traceLimit)
+		StopCapture();
+}
+
+void RecordTraceHistory()
+{
+	TraceRecord& record = traceHistory[traceHistoryNext];
+
+	BeginTraceRecord(record);
+	ProcessInstruction();
+	EndTraceRecord(record);
+
+	traceHistoryNext = (traceHistoryNext + 1) % traceHistory.size();
+
+	if (traceHistoryCount < traceHistory.size())
+		++traceHistoryCount;
+}
+
+// Runs one instruction while a trace is active
+void TraceStep()
+{
+	if (tracePcPages[PC >> 8])
+		CheckTracePcTriggers();
+
+	if (traceCapturing)
+	{
+		if (PC >= traceWindowLow && PC <= traceWindowHigh)
+			TraceInstruction();
+		else
+			ProcessInstruction();
+	}
+	else if (!traceHistory.empty())
+	{
+		RecordTraceHistory();
+	}
+	else
+	{
+		ProcessInstruction();
+	}
+
+	// Write triggers fire mid instruction, act on them once it has been recorded
+	if (tracePending >= 0)
+	{
+		if (tracePending == TRACE_START)
+			StartCapture();
+		else
+			StopCapture();
+
+		tracePending = -1;
+	}
+}
+
+bool StartTrace(const char* filename, bool compress, bool binary)
+{
+	tracefile.open(filename, std::ios::binary | std::ios::trunc);
+
+	if (!tracefile)
+		return false;
+
+	traceCompress = compress;
+	traceBinary = binary;
+
+	if (compress)
+		tracefile.write("NTLZ", 4);
+
+	traceHead.store(0);
+	traceTail.store(0);
+	traceStalls = 0;
+	traceDropped = 0;
+	traceGap = 0;
+	traceHistoryNext = 0;
+	traceHistoryCount = 0;
+
+	// Capture from the first instruction unless something has to start it
+	traceCapturing = traceStartFrame == 0;
+
+	for (const TraceTrigger& trigger : tracePcTriggers)
+	{
+		if (trigger.action == TRACE_START)
+			traceCapturing = false;
+	}
+
+	for (const TraceTrigger& trigger : traceWriteTriggers)
+	{
+		if (trigger.action == TRACE_START)
+			traceCapturing = false;
+	}
+
+	traceCaptured = 0;
+	traceRunning.store(true);
+	traceThread = std::thread(TraceWriterThread);
+	tracing = true;
+
+	return true;
+}
+
+void StopTrace()
+{
+	if (!tracing)
+		return;
+
+	tracing = false;
+
+	// Records dropped at the very end are marked once the writer makes room
+	if (traceGap)
+	{
+		uint64_t head = traceHead.load(std::memory_order_relaxed);
+
+		while (head - traceTail.load(std::memory_order_acquire) == TraceRingSize)
+			std::this_thread::yield();
+
+		MarkDroppedRecords(head);
+		traceHead.store(head, std::memory_order_release);
+	}
+
+	traceRunning.store(false, std::memory_order_release);
+	traceThread.join();
+	tracefile.close();
+
+	if (traceDropped)
+		printf("Trace dropped %llu records, the ring was full\n", static_cast<unsigned long long>(traceDropped));
+	else if (traceStalls)
+		printf("Trace ring was full %llu times\n", static_cast<unsigned long long>(traceStalls));
+}
+
+// Expand a compressed trace back to text
+// Text passes through, binary records are formatted with the disassembler
+class TraceConverter
+{
+public:
+	TraceConverter(ofstream& out) : out(out)
+	{
+	}
+
+	void Write(const uint8_t* data, size_t size)
+	{
+		pending.insert(pending.end(), data, data + size);
+
+		if (!started)
+		{
+			if (pending.size() < 4)
+				return;
+
+			started = true;
+			binary = memcmp(pending.data(), "NTBN", 4) == 0;
+
+			if (binary)
+				pending.erase(pending.begin(), pending.begin() + 4);
+		}
+
+		if (!binary)
+		{
+			out.write((char*)pending.data(), pending.size());
+			pending.clear();
+			return;
+		}
+
+		size_t offset = 0;
+		std::vector<char> text;
+
+		for (; offset + PackedTraceRecordSize <= pending.size(); offset += PackedTraceRecordSize)
+		{
+			TraceRecord record;
+			char line[MaxTraceLine];
+
+			UnpackTraceRecord(pending.data() + offset, record);
+			text.insert(text.end(), line, line + FormatTraceRecord(record, line));
+		}
+
+		out.write(text.data(), text.size());
+		pending.erase(pending.begin(), pending.begin() + offset);
+	}
+
+	// Whatever is left over, a short file that is text or a partial record
+	void Finish()
+	{
+		if (!binary)
+			out.write((char*)pending.data(), pending.size());
+	}
+
+private:
+	ofstream& out;
+	std::vector<uint8_t> pending;
+	bool started = false;
+	bool binary = false;
+};
+
+// Writes a trace file as text, decompressing and disassembling it as needed
+int ConvertTrace(const char* source, const char* destination)
+{
+	ifstream in(source, std::ios::binary);
+	char magic[4];
+
+	if (!in)
+	{
+		printf("Can't open %s\n", source);
+		return 1;
+	}
+
+	ofstream out(destination, std::ios::binary | std::ios::trunc);
+	TraceConverter converter(out);
+
+	if (!in.read(magic, 4) || memcmp(magic, "NTLZ", 4) != 0)
+	{
+		std::vector<uint8_t> chunk(TraceBlockSize);
+
+		in.clear();
+		in.seekg(0, std::ios::beg);
+
+		while (in.read((char*)chunk.data(), chunk.size()) || in.gcount())
+		{
+			converter.Write(chunk.data(), in.gcount());
+		}
+
+		converter.Finish();
+		return 0;
+	}
+
+	std::vector<uint8_t> compressed;
+	std::vector<uint8_t> block;
+	uint32_t header[2];
+
+	while (in.read((char*)header, sizeof(header)))
+	{
+		compressed.resize(header[1]);
+		block.resize(header[0]);
+
+		if (!in.read((char*)compressed.data(), header[1]) ||
+			DecompressLZ(compressed.data(), header[1], block.data(), header[0]) != header[0])
+		{
+			printf("%s is corrupt\n", source);
+			return 1;
+		}
+
+		converter.Write(block.data(), header[0]);
+	}
+
+	converter.Finish();
+	return 0;
+}
+
+void Initialize()
+{
+	PC = 0;
+	SP = 0xFF;
+	A = 0;
+	C = 0;
+	Z = 0;
+	I = 1;
+	D = 0;
+	B = 0;
+	V = 0;
+	N = 0;
+
+	memset(RAM, powerOnRamValue, sizeof(RAM));
+	memset(OAM, 0, sizeof(OAM));
+	memset(CHR, 0, sizeof(CHR));
+
+	MapMemory();
+
+	cycles = 0;
+	ResetEvents();
+	ResetAPU();
+	ResetPPU();
+	ResetControllers();
+}
+
+uint16_t GetResetVector()
+{
+	uint8_t low = ReadMemory(0xFFFC);
+	uint8_t high = ReadMemory(0xFFFD);
+	return low | (high << 8);
+}
+
+// ROM images
+// PRG and CHR ROM are read once per file and shared by every machine running the cartridge.
+// Images are reference counted, the running machine holds one reference and each captured
+// state another. An image is freed with its last reference.
+struct RomImage
+{
+	std::string filename;
+	uint64_t hash; // Hash of the whole file, movies are checked against it
+	uint8_t prg[PrgWindowSize];
+	uint8_t chr[8192];
+	uint32_t prgSize;
+	bool chrRAM;
+	bool battery; // SaveWorkRAM is kept in a .sav file
+	Mirroring mirroring;
+	int refs;
+};
+
+std::vector<RomImage*> romImages; // Images in use, at most one per file
+RomImage* loadedRom; // Image mapped into the running machine
+
+RomImage* ReadRomImage(const char* filename)
+{
+	ifstream file;
+	file.open(filename, std::ios::binary);
+
+	if (!file)
+		return nullptr;
+
+	RomImage* image = new RomImage();
+	image->filename = filename;
+
+	std::vector<char> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	image->hash = XXHash64(contents.data(), contents.size(), 0);
+	file.clear();
+	file.seekg(0, std::ios::beg);
+
+	// iNES header, byte 4 is the number of 16k PRG banks
+	uint8_t header[16];
+	file.read((char*)header, sizeof(header));
+
+	image->prgSize = header[4] == 1 ? 0x4000 : PrgWindowSize;
+	image->mirroring = (header[6] & 0x01) ? MIRROR_VERTICAL : MIRROR_HORIZONTAL;
+	image->battery = (header[6] & 0x02) != 0;
+
+	// Skip the trainer
+	std::streamoff prgStart = (header[6] & 0x04) ? 16 + 512 : 16;
+	file.seekg(prgStart, std::ios::beg);
+	file.read((char*)image->prg, image->prgSize);
+
+	// Without mapper support larger carts get their first and last banks,
+	// which is where the reset code lives for the common mappers
+	if (header[4] > 2)
+	{
+		file.seekg(prgStart + (header[4] - 1) * 0x4000, std::ios::beg);
+		file.read((char*)image->prg + 0x4000, 0x4000);
+	}
+
+	// Byte 5 is the number of 8k CHR ROM banks, 0 means the cart has CHR RAM
+	image->chrRAM = header[5] == 0;
+
+	if (!image->chrRAM)
+	{
+		file.seekg(prgStart + header[4] * 0x4000, std::ios::beg);
+		file.read((char*)image->chr, sizeof(image->chr));
+	}
+
+	file.close();
+
+	return image;
+}
+
+void RetainRomImage(RomImage* image)
+{
+	if (image)
+		++image->refs;
+}
+
+void ReleaseRomImage(RomImage* image)
+{
+	if (!image || --image->refs > 0)
+		return;
+
+	romImages.erase(std::find(romImages.begin(), romImages.end(), image));
+	delete image;
+}
+
+// Returns the image of a file with a new reference, reading the file only if no one holds it
+RomImage* AcquireRomImage(const char* filename)
+{
+	for (RomImage* image : romImages)
+	{
+		if (image->filename == filename)
+		{
+			RetainRomImage(image);
+			return image;
+		}
+	}
+
+	RomImage* image = ReadRomImage(filename);
+
+	if (image)
+	{
+		image->refs = 1;
+		romImages.push_back(image);
+	}
+
+	return image;
+}
+
+// Maps an image into the running machine, which takes over the caller's reference
+void MapRomImage(RomImage* image)
+{
+	ReleaseRomImage(loadedRom);
+	loadedRom = image;
+
+	ROM = image->prg;
+	prgSize = image->prgSize;
+	mirroring = image->mirroring;
+	chrRAM = image->chrRAM;
+	romHash = image->hash;
+	patternTables = chrRAM ? CHR : image->chr;
+	InvalidateTiles();
+
+	MapMemory();
+	AnalyzeCode();
+}
+
+bool LoadROM(const char* filename)
+{
+	RomImage* image = AcquireRomImage(filename);
+
+	if (!image)
+		return false;
+
+	MapRomImage(image);
+
+	return true;
+}
+
+// Battery saves
+// SaveWorkRAM of a battery cart is the .sav file next to the ROM, mapped shared so every
+// write to $6000-$7FFF lands in the file without a save step. Other carts keep anonymous
+// memory, as do the regression and batch runners so their runs stay reproducible.
+#ifdef _WIN32
+std::string saveFile; // Written back on close
+#else
+uint8_t* saveMapping; // Mapped .sav, null if none
+#endif
+
+std::string SaveFileName(const char* romFile)
+{
+	std::string name(romFile);
+	size_t dot = name.find_last_of('.');
+
+	if (dot != std::string::npos && name.find_first_of("/\\", dot) == std::string::npos)
+		name.erase(dot);
+
+	return name + ".sav";
+}
+
+bool OpenSaveFile(const char* romFile)
+{
+	std::string name = SaveFileName(romFile);
+
+#ifdef _WIN32
+	ifstream file(name, std::ios::binary);
+
+	if (file)
+		file.read((char*)workRAM, SaveWorkRAMSize);
+
+	saveFile = name;
+#else
+	int descriptor = open(name.c_str(), O_RDWR | O_CREAT, 0644);
+
+	if (descriptor < 0)
+	{
+		cout << "Can't open " << name << endl;
+		return false;
+	}
+
+	// A new or short file grows to the full 8k, the new part reads as zero
+	struct stat info;
+
+	if (fstat(descriptor, &info) != 0 || (info.st_size < SaveWorkRAMSize && ftruncate(descriptor, SaveWorkRAMSize) != 0))
+	{
+		cout << "Can't size " << name << endl;
+		close(descriptor);
+		return false;
+	}
+
+	void* mapping = mmap(nullptr, SaveWorkRAMSize, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0);
+	close(descriptor);
+
+	if (mapping == MAP_FAILED)
+	{
+		cout << "Can't map " << name << endl;
+		return false;
+	}
+
+	saveMapping = (uint8_t*)mapping;
+	SaveWorkRAM = saveMapping;
+
+	// Point $6000-$7FFF and the decode cache at the file
+	MapMemory();
+	AnalyzeCode();
+#endif
+
+	return true;
+}
+
+void CloseSaveFile()
+{
+#ifdef _WIN32
+	if (!saveFile.empty())
+	{
+		ofstream file(saveFile, std::ios::binary | std::ios::trunc);
+		file.write((const char*)workRAM, SaveWorkRAMSize);
+		saveFile.clear();
+	}
+#else
+	if (!saveMapping)
+		return;
+
+	SaveWorkRAM = workRAM;
+	MapMemory();
+
+	munmap(saveMapping, SaveWorkRAMSize);
+	saveMapping = nullptr;
+#endif
+}
+
+// Machine templates
+// A machine is captured right after its cartridge is loaded, later runs of the same cartridge
+// restore that capture with a few copies instead of clearing memory and parsing the file again.
+// ROM and CHR ROM stay where they are and are shared by every state, only the writable parts
+// are copied. The pool holds preallocated states so runs can be swapped in and out of the
+// emulator without touching the allocator. A state can be taken in the middle of a frame,
+// the lines drawn so far are kept with it. Line sprites and the background line are built
+// again at the start of every line, so they are not.
+struct MachineState
+{
+	uint8_t a, x, y, sp;
+	uint16_t pc;
+	uint8_t c, z, i, d, b, v, n;
+	uint64_t cycles;
+	uint64_t frameCount;
+	uint8_t ram[2048];
+	uint8_t saveWorkRAM[SaveWorkRAMSize];
+
+	uint8_t ppuRegisters[8];
+	uint8_t oam[256];
+	uint8_t chrRAM[8192]; // Only used by carts without CHR ROM
+	uint8_t nametables[2048];
+	uint8_t paletteRAM[32];
+	uint16_t ppuV, ppuT;
+	uint8_t ppuX, ppuW, ppuReadBuffer;
+	int ppuScanline;
+	uint64_t ppuNextLine;
+	bool ppuOddFrame, nmiPending, frameReady;
+	bool renderingFrame;
+	FrameBuffer frame; // Lines of the frame in progress drawn so far
+
+	PulseChannel pulse1, pulse2;
+	TriangleChannel triangle;
+	NoiseChannel noise;
+	DmcChannel dmc;
+	uint8_t frameCounterMode, frameIrqInhibit, frameIrq, dmcIrq, frameSequencerStep;
+	uint64_t frameSequencerNext;
+	uint64_t apuTime;
+	uint8_t apuIrq;
+
+	uint8_t controllerButtons[2], controllerShift[2], controllerStrobe;
+
+	ScheduledEvent eventHeap[EVENT_COUNT];
+	uint8_t eventSlots[EVENT_COUNT];
+
+	RomImage* rom; // Cartridge the state belongs to, holds a reference
+};
+
+// Visible lines of the frame in progress already drawn, none once it has been handed out
+int DrawnLines()
+{
+	return renderingFrame && ppuScanline <= ScreenHeight ? ppuScanline : 0;
+}
+
+void CaptureMachine(MachineState& state)
+{
+	state.a = A;
+	state.x = X;
+	state.y = Y;
+	state.sp = SP;
+	state.pc = PC;
+	state.c = C;
+	state.z = Z;
+	state.i = I;
+	state.d = D;
+	state.b = B;
+	state.v = V;
+	state.n = N;
+	state.cycles = cycles;
+	state.frameCount = frameCount;
+	memcpy(state.ram, RAM, sizeof(RAM));
+	memcpy(state.saveWorkRAM, SaveWorkRAM, SaveWorkRAMSize);
+
+	memcpy(state.ppuRegisters, PPU, sizeof(PPU));
+	memcpy(state.oam, OAM, sizeof(OAM));
+
+	if (chrRAM)
+		memcpy(state.chrRAM, CHR, sizeof(CHR));
+
+	memcpy(state.nametables, nametables, sizeof(nametables));
+	memcpy(state.paletteRAM, paletteRAM, sizeof(paletteRAM));
+	state.ppuV = ppuV;
+	state.ppuT = ppuT;
+	state.ppuX = ppuX;
+	state.ppuW = ppuW;
+	state.ppuReadBuffer = ppuReadBuffer;
+	state.ppuScanline = ppuScanline;
+	state.ppuNextLine = ppuNextLine;
+	state.ppuOddFrame = ppuOddFrame;
+	state.nmiPending = nmiPending;
+	state.frameReady = frameReady;
+	state.renderingFrame = renderingFrame;
+	memcpy(state.frame.pixels, framebuffer->pixels, DrawnLines() * ScreenWidth);
+	memcpy(state.frame.emphasis, framebuffer->emphasis, DrawnLines());
+
+	state.pulse1 = pulse1;
+	state.pulse2 = pulse2;
+	state.triangle = triangle;
+	state.noise = noise;
+	state.dmc = dmc;
+	state.frameCounterMode = frameCounterMode;
+	state.frameIrqInhibit = frameIrqInhibit;
+	state.frameIrq = frameIrq;
+	state.dmcIrq = dmcIrq;
+	state.frameSequencerStep = frameSequencerStep;
+	state.frameSequencerNext = frameSequencerNext;
+	state.apuTime = apuTime;
+	state.apuIrq = apuIrq;
+
+	memcpy(state.controllerButtons, controllerButtons, sizeof(controllerButtons));
+	memcpy(state.controllerShift, controllerShift, sizeof(controllerShift));
+	state.controllerStrobe = controllerStrobe;
+
+	memcpy(state.eventHeap, eventHeap, sizeof(eventHeap));
+	memcpy(state.eventSlots, eventSlots, sizeof(eventSlots));
+
+	if (state.rom != loadedRom)
+	{
+		RetainRomImage(loadedRom);
+		ReleaseRomImage(state.rom);
+		state.rom = loadedRom;
+	}
+}
+
+// Switches cartridge first when the state belongs to another one. Audio restarts from an empty buffer.
+void RestoreMachine(const MachineState& state)
+{
+	if (state.rom != loadedRom)
+	{
+		RetainRomImage(state.rom);
+		MapRomImage(state.rom);
+	}
+
+	A = state.a;
+	X = state.x;
+	Y = state.y;
+	SP = state.sp;
+	PC = state.pc;
+	C = state.c;
+	Z = state.z;
+	I = state.i;
+	D = state.d;
+	B = state.b;
+	V = state.v;
+	N = state.n;
+	cycles = state.cycles;
+	frameCount = state.frameCount;
+	memcpy(RAM, state.ram, sizeof(RAM));
+	memcpy(SaveWorkRAM, state.saveWorkRAM, SaveWorkRAMSize);
+
+	memcpy(PPU, state.ppuRegisters, sizeof(PPU));
+	memcpy(OAM, state.oam, sizeof(OAM));
+
+	if (chrRAM)
+	{
+		memcpy(CHR, state.chrRAM, sizeof(CHR));
+		InvalidateTiles();
+	}
+
+	memcpy(nametables, state.nametables, sizeof(nametables));
+	memcpy(paletteRAM, state.paletteRAM, sizeof(paletteRAM));
+	ppuV = state.ppuV;
+	ppuT = state.ppuT;
+	ppuX = state.ppuX;
+	ppuW = state.ppuW;
+	ppuReadBuffer = state.ppuReadBuffer;
+	ppuScanline = state.ppuScanline;
+	ppuNextLine = state.ppuNextLine;
+	ppuOddFrame = state.ppuOddFrame;
+	nmiPending = state.nmiPending;
+	frameReady = state.frameReady;
+	renderingFrame = state.renderingFrame;
+	memcpy(framebuffer->pixels, state.frame.pixels, DrawnLines() * ScreenWidth);
+	memcpy(framebuffer->emphasis, state.frame.emphasis, DrawnLines());
+
+	pulse1 = state.pulse1;
+	pulse2 = state.pulse2;
+	triangle = state.triangle;
+	noise = state.noise;
+	dmc = state.dmc;
+	frameCounterMode = state.frameCounterMode;
+	frameIrqInhibit = state.frameIrqInhibit;
+	frameIrq = state.frameIrq;
+	dmcIrq = state.dmcIrq;
+	frameSequencerStep = state.frameSequencerStep;
+	frameSequencerNext = state.frameSequencerNext;
+	apuTime = state.apuTime;
+	apuIrq = state.apuIrq;
+	ClearBlip(cycles);
+
+	memcpy(controllerButtons, state.controllerButtons, sizeof(controllerButtons));
+	memcpy(controllerShift, state.controllerShift, sizeof(controllerShift));
+	controllerStrobe = state.controllerStrobe;
+
+	memcpy(eventHeap, state.eventHeap, sizeof(eventHeap));
+	memcpy(eventSlots, state.eventSlots, sizeof(eventSlots));
+	nextEventCycle = eventHeap[0].cycle;
+
+	// Cached ROM code stays valid, code in RAM may have been replaced
+	ForgetWritableCode();
+}
+
+MachineState powerOnState;
+std::string powerOnRom; // ROM file the template was captured from, empty if none
+uint8_t powerOnRamFill; // RAM fill byte it was captured with
+
+// Powers on with the cartridge loaded and the CPU at the reset vector. Only the first
+// run of a cartridge reads the file, repeats restore the captured template.
+bool PowerOn(const char* filename)
+{
+	if (powerOnRom == filename && powerOnRamFill == powerOnRamValue)
+	{
+		RestoreMachine(powerOnState);
+		return true;
+	}
+
+	powerOnRom.clear();
+	Initialize();
+	frameCount = 0;
+
+	// A new cartridge starts with cleared save RAM, not what the last one left there
+	memset(workRAM, 0, SaveWorkRAMSize);
+
+	if (!LoadROM(filename))
+		return false;
+
+	PC = GetResetVector();
+
+	CaptureMachine(powerOnState);
+	powerOnRom = filename;
+	powerOnRamFill = powerOnRamValue;
+	return true;
+}
+
+std::vector<MachineState*> machinePool; // Free states
+
+void ReserveMachines(size_t count)
+{
+	while (machinePool.size() < count)
+	{
+		machinePool.push_back(new MachineState());
+	}
+}
+
+// Hands out a state at power on for the loaded cartridge
+MachineState* AcquireMachine()
+{
+	ReserveMachines(1);
+
+	MachineState* state = machinePool.back();
+	machinePool.pop_back();
+
+	RomImage* previous = state->rom;
+	memcpy(state, &powerOnState, sizeof(MachineState));
+	RetainRomImage(state->rom);
+	ReleaseRomImage(previous);
+	return state;
+}
+
+void ReleaseMachine(MachineState* state)
+{
+	machinePool.push_back(state);
+}
+
+// Parks the running machine in one state and resumes another
+void SwitchMachine(MachineState& current, const MachineState& next)
+{
+	CaptureMachine(current);
+	RestoreMachine(next);
+}
+
+// CPU tests
+// Runs the single step JSON test vectors (one file per opcode, e.g. a9.json) for
+// every official opcode. Each test sets up the registers and a few bytes of a
+// flat 64k memory, executes one instruction and checks the final state and
+// cycle count.
+
+const uint8_t OfficialOpcodes[151] =
+{
+	0x00, 0x01, 0x05, 0x06, 0x08, 0x09, 0x0A, 0x0D, 0x0E, 0x10, 0x11, 0x15, 0x16, 0x18, 0x19, 0x1D,
+	0x1E, 0x20, 0x21, 0x24, 0x25, 0x26, 0x28, 0x29, 0x2A, 0x2C, 0x2D, 0x2E, 0x30, 0x31, 0x35, 0x36,
+	0x38, 0x39, 0x3D, 0x3E, 0x40, 0x41, 0x45, 0x46, 0x48, 0x49, 0x4A, 0x4C, 0x4D, 0x4E, 0x50, 0x51,
+	0x55, 0x56, 0x58, 0x59, 0x5D, 0x5E, 0x60, 0x61, 0x65, 0x66, 0x68, 0x69, 0x6A, 0x6C, 0x6D, 0x6E,
+	0x70, 0x71, 0x75, 0x76, 0x78, 0x79, 0x7D, 0x7E, 0x81, 0x84, 0x85, 0x86, 0x88, 0x8A, 0x8C, 0x8D,
+	0x8E, 0x90, 0x91, 0x94, 0x95, 0x96, 0x98, 0x99, 0x9A, 0x9D, 0xA0, 0xA1, 0xA2, 0xA4, 0xA5, 0xA6,
+	0xA8, 0xA9, 0xAA, 0xAC, 0xAD, 0xAE, 0xB0, 0xB1, 0xB4, 0xB5, 0xB6, 0xB8, 0xB9, 0xBA, 0xBC, 0xBD,
+	0xBE, 0xC0, 0xC1, 0xC4, 0xC5, 0xC6, 0xC8, 0xC9, 0xCA, 0xCC, 0xCD, 0xCE, 0xD0, 0xD1, 0xD5, 0xD6,
+	0xD8, 0xD9, 0xDD, 0xDE, 0xE0, 0xE1, 0xE4, 0xE5, 0xE6, 0xE8, 0xE9, 0xEA, 0xEC, 0xED, 0xEE, 0xF0,
+	0xF1, 0xF5, 0xF6, 0xF8, 0xF9, 0xFD, 0xFE
+};
+
+enum JsonType
+{
+	JSON_NULL,
+	JSON_NUMBER,
+	JSON_STRING,
+	JSON_ARRAY,
+	JSON_OBJECT
+};
+
+struct JsonValue
+{
+	JsonType type = JSON_NULL;
+	double number = 0;
+	std::string text;
+	std::vector<JsonValue> items;
+	std::vector<std::string> keys; // Object member names, parallel to items
+
+	const JsonValue* Find(const char* key) const
+	{
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			if (keys[i] == key)
+				return &items[i];
+		}
+
+		return nullptr;
+	}
+};
+
+// Minimal parser, enough for the test vector files
+const char* ParseJson(const char* p, JsonValue& value)
+{
+	while (isspace(*p))
+		++p;
+
+	if (*p == '[' || *p == '{')
+	{
+		char close = *p == '[' ? ']' : '}';
+		value.type = *p == '[' ? JSON_ARRAY : JSON_OBJECT;
+		++p;
+
+		while (p && *p)
+		{
+			while (isspace(*p) || *p == ',')
+				++p;
+
+			if (*p == close)
+				return p + 1;
+
+			if (value.type == JSON_OBJECT)
+			{
+				JsonValue key;
+				p = ParseJson(p, key);
+
+				if (!p)
+					return nullptr;
+
+				while (isspace(*p) || *p == ':')
+					++p;
+
+				value.keys.push_back(key.text);
+			}
+
+			value.items.emplace_back();
+			p = ParseJson(p, value.items.back());
+		}
+
+		return nullptr;
+	}
+	else if (*p == '"')
+	{
+		value.type = JSON_STRING;
+		const char* end = strchr(p + 1, '"');
+
+		if (!end)
+			return nullptr;
+
+		value.text.assign(p + 1, end);
+		return end + 1;
+	}
+	else if (*p == '-' || isdigit(*p))
+	{
+		char* end;
+		value.type = JSON_NUMBER;
+		value.number = strtod(p, &end);
+		return end;
+	}
+	else if (strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0)
+	{
+		value.number = *p == 't';
+		return p + 4;
+	}
+	else if (strncmp(p, "false", 5) == 0)
+	{
+		return p + 5;
+	}
+
+	return nullptr;
+}
+
+int JsonInt(const JsonValue& object, const char* key)
+{
+	const JsonValue* value = object.Find(key);
+	return value ? static_cast<int>(value->number) : 0;
+}
+
+uint8_t testMemory[0x10000];
+
+void SetTestState(const JsonValue& state)
+{
+	PC = JsonInt(state, "pc");
+	SP = JsonInt(state, "s");
+	A = JsonInt(state, "a");
+	X = JsonInt(state, "x");
+	Y = JsonInt(state, "y");
+
+	uint8_t P = JsonInt(state, "p");
+	C = P & 0x01;
+	Z = (P >> 1) & 0x01;
+	I = (P >> 2) & 0x01;
+	D = (P >> 3) & 0x01;
+	V = (P >> 6) & 0x01;
+	N = (P >> 7) & 0x01;
+
+	if (const JsonValue* ram = state.Find("ram"))
+	{
+		for (const JsonValue& entry : ram->items)
+		{
+			testMemory[static_cast<int>(entry.items[0].number)] = static_cast<uint8_t>(entry.items[1].number);
+		}
+	}
+}
+
+// Returns a description of the first mismatch, or an empty string when the state matches
+std::string CheckTestState(const JsonValue& state, uint64_t elapsed, size_t expectedCycles)
+{
+	char buffer[128];
+	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (V << 6) | (N << 7);
+
+	// Bits 4 and 5 only exist when P is pushed
+	const struct { const char* name; int actual; int expected; } registers[] =
+	{
+		{ "pc", PC, JsonInt(state, "pc") },
+		{ "s", SP, JsonInt(state, "s") },
+		{ "a", A, JsonInt(state, "a") },
+		{ "x", X, JsonInt(state, "x") },
+		{ "y", Y, JsonInt(state, "y") },
+		{ "p", P, JsonInt(state, "p") & 0xCF },
+	};
+
+	for (const auto& r : registers)
+	{
+		if (r.actual != r.expected)
+		{
+			sprintf(buffer, "%s is $%02x, expected $%02x", r.name, r.actual, r.expected);
+			return buffer;
+		}
+	}
+
+	if (const JsonValue* ram = state.Find("ram"))
+	{
+		for (const JsonValue& entry : ram->items)
+		{
+			int address = static_cast<int>(entry.items[0].number);
+			int expected = static_cast<int>(entry.items[1].number);
+
+			if (testMemory[address] != expected)
+			{
+				sprintf(buffer, "$%04x is $%02x, expected $%02x", address, testMemory[address], expected);
+				return buffer;
+			}
+		}
+	}
+
+	if (elapsed != expectedCycles)
+	{
+		sprintf(buffer, "took %d cycles, expected %d", static_cast<int>(elapsed), static_cast<int>(expectedCycles));
+		return buffer;
+	}
+
+	return std::string();
+}
+
+int RunCPUTests(const char* directory)
+{
+	int failedTests = 0;
+	int failedOpcodes = 0;
+	int missingFiles = 0;
+
+	// Swap in a flat 64k address space, all pages plain memory
+	for (int page = 0; page < 256; ++page)
+	{
+		memoryReadPages[page] = testMemory + (page << 8);
+		memoryWritePages[page] = memoryReadPages[page];
+	}
+
+	// Cache the test memory so the tests run through the decode cache
+	testCodeMemory = testMemory;
+	UpdatePages();
+	ResetDecodeCache();
+
+	for (uint8_t opcode : OfficialOpcodes)
+	{
+		char filename[512];
+		sprintf(filename, "%s/%02x.json", directory, opcode);
+
+		ifstream file(filename, std::ios::binary);
+		if (!file)
+		{
+			printf("%02x: missing %s\n", opcode, filename);
+			++missingFiles;
+			continue;
+		}
+
+		std::string contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+		JsonValue tests;
+		if (!ParseJson(contents.c_str(), tests) || tests.type != JSON_ARRAY)
+		{
+			printf("%02x: could not parse %s\n", opcode, filename);
+			++failedOpcodes;
+			continue;
+		}
+
+		int failed = 0;
+
+		for (const JsonValue& test : tests.items)
+		{
+			const JsonValue* initial = test.Find("initial");
+			const JsonValue* expected = test.Find("final");
+			const JsonValue* busCycles = test.Find("cycles");
+
+			if (!initial || !expected)
+				continue;
+
+			// The state is written around the cache, so the last test's code is dropped first.
+			// The second run fetches the instruction from the cache the first run filled.
+			ForgetWritableCode();
+			std::string error;
+
+			for (int run = 0; run < 2 && error.empty(); ++run)
+			{
+				SetTestState(*initial);
+
+				uint64_t start = cycles;
+				ProcessInstruction();
+
+				error = CheckTestState(*expected, cycles - start, busCycles ? busCycles->items.size() : 0);
+
+				if (!error.empty() && run == 1)
+					error = "cached: " + error;
+			}
+
+			if (!error.empty())
+			{
+				// Only show the first few failures per opcode
+				if (failed < 3)
+				{
+					const JsonValue* name = test.Find("name");
+					printf("%02x: \"%s\" %s\n", opcode, name ? name->text.c_str() : "", error.c_str());
+				}
+
+				++failed;
+			}
+		}
+
+		if (failed)
+		{
+			printf("%02x: %d of %d failed\n", opcode, failed, static_cast<int>(tests.items.size()));
+			failedTests += failed;
+			++failedOpcodes;
+		}
+	}
+
+	testCodeMemory = nullptr;
+	MapMemory();
+
+	printf("%d of %d opcodes passed", 151 - failedOpcodes - missingFiles, 151);
+	if (missingFiles)
+		printf(", %d missing", missingFiles);
+	printf(", %d failed tests\n", failedTests);
+
+	return failedOpcodes + missingFiles;
+}
+
+void CheckFrameConditions();
+
+void EndFrame()
+{
+	frameReady = false;
+	++frameCount;
+
+	PublishFrame(frameCount);
+	EndAudioFrame();
+	ApplyInputScript(frameCount + 1);
+	RecordMovieFrame();
+	CheckFrameConditions();
+
+	if (tracing)
+		TraceFrame(frameCount);
+}
+
+// Services every event whose deadline the CPU has reached
+void RunEvents()
+{
+	if (cycles >= EventCycle(EVENT_PPU))
+	{
+		RunPPU(cycles);
+
+		if (frameReady)
+			EndFrame();
+
+		if (nmiPending)
+			ProcessNMI();
+	}
+
+	if (cycles >= EventCycle(EVENT_FRAMECOUNTER) || cycles >= EventCycle(EVENT_DMC))
+		RunAPU(cycles);
+
+	if (cycles >= EventCycle(EVENT_IRQ))
+	{
+		if (!apuIrq)
+			ScheduleEvent(EVENT_IRQ, EventNever);
+		else if (!I)
+			ProcessIRQ();
+	}
+}
+
+// Runs one instruction and whatever it caught up on
+void Step()
+{
+	if (tracing)
+		TraceStep();
+	else
+		ProcessInstruction();
+
+	if (cycles >= nextEventCycle)
+		RunEvents();
+}
+
+// Runs instructions with no other checks up to the earliest deadline, then services it.
+// Returns the number of instructions run.
+uint64_t RunToNextEvent()
+{
+	uint64_t instructions = 0;
+
+	do
+	{
+		ProcessInstruction();
+		++instructions;
+	}
+	while (cycles < nextEventCycle);
+
+	RunEvents();
+
+	return instructions;
+}
+
+// Returns the number of instructions run
+uint64_t RunFrames(uint64_t count)
+{
+	uint64_t end = frameCount + count;
+	uint64_t instructions = 0;
+
+	while (frameCount < end)
+	{
+		if (tracing)
+		{
+			Step();
+			++instructions;
+		}
+		else
+		{
+			instructions += RunToNextEvent();
+		}
+	}
+
+	return instructions;
+}
+
+// Parses an address or range in hex ("6000", "$8000-$80FF") with an optional value ("6000=80")
+bool ParseAddressRange(const char* text, uint16_t& low, uint16_t& high, int& value)
+{
+	char* end;
+
+	if (*text == '$')
+		++text;
+
+	low = high = static_cast<uint16_t>(strtoul(text, &end, 16));
+	value = -1;
+
+	if (*end == '-')
+	{
+		text = end + 1;
+
+		if (*text == '$')
+			++text;
+
+		high = static_cast<uint16_t>(strtoul(text, &end, 16));
+	}
+
+	if (*end == '=')
+	{
+		text = end + 1;
+
+		if (*text == '$')
+			++text;
+
+		value = static_cast<int>(strtoul(text, &end, 16)) & 0xFF;
+	}
+
+	return *end == 0 && low <= high;
+}
+
+// Run conditions
+// A run stops at the first condition that is met. Memory conditions trap the
+// page they watch so they are only checked on writes to that page, PC
+// conditions switch to a separate loop that checks a bitmap, and frame and wall
+// clock limits are checked once per frame, so a run without conditions pays
+// nothing per instruction beyond the cycle limit compare.
+
+struct MemoryCondition
+{
+	uint16_t address;
+	bool notEqual;
+	uint8_t value;
+};
+
+std::vector<MemoryCondition> memoryConditions;
+uint8_t stopPcs[0x10000 / 8]; // One bit per address
+uint32_t stopPcCount; // Bits set in stopPcs
+bool stopOnPc;
+uint64_t stopCycle = UINT64_MAX;
+uint64_t stopFrame = UINT64_MAX;
+uint64_t stopInstructions = UINT64_MAX;
+double stopSeconds; // Wall clock budget, 0 for none
+std::chrono::steady_clock::time_point runStart;
+bool stopRequested;
+std::string stopReason;
+
+void RequestStop(const std::string& reason)
+{
+	if (stopRequested)
+		return;
+
+	stopRequested = true;
+	stopReason = reason;
+}
+
+// Parses "6000!=80" or "6000==80", hex with an optional $
+bool AddMemoryCondition(const char* text)
+{
+	MemoryCondition condition;
+	char* end;
+
+	if (*text == '$')
+		++text;
+
+	condition.address = static_cast<uint16_t>(strtoul(text, &end, 16));
+
+	if (strncmp(end, "!=", 2) == 0)
+		condition.notEqual = true;
+	else if (strncmp(end, "==", 2) == 0)
+		condition.notEqual = false;
+	else
+		return false;
+
+	text = end + 2;
+
+	if (*text == '$')
+		++text;
+
+	condition.value = static_cast<uint8_t>(strtoul(text, &end, 16));
+
+	if (*end != 0)
+		return false;
+
+	memoryConditions.push_back(condition);
+	pageTraps[condition.address >> 8] |= TRAP_WRITE;
+	UpdatePages();
+
+	return true;
+}
+
+void AddPcCondition(uint16_t low, uint16_t high)
+{
+	for (uint32_t address = low; address <= high; ++address)
+	{
+		uint8_t bit = 1 << (address & 0x07);
+
+		if (!(stopPcs[address >> 3] & bit))
+			++stopPcCount;
+
+		stopPcs[address >> 3] |= bit;
+	}
+
+	stopOnPc = stopPcCount != 0;
+}
+
+void RemovePcCondition(uint16_t low, uint16_t high)
+{
+	for (uint32_t address = low; address <= high; ++address)
+	{
+		uint8_t bit = 1 << (address & 0x07);
+
+		if (stopPcs[address >> 3] & bit)
+			--stopPcCount;
+
+		stopPcs[address >> 3] &= ~bit;
+	}
+
+	stopOnPc = stopPcCount != 0;
+}
+
+// Called for writes to trapped pages
+void CheckMemoryConditions(uint16_t address, uint8_t value)
+{
+	for (const MemoryCondition& condition : memoryConditions)
+	{
+		if (condition.address == address && (value != condition.value) == condition.notEqual)
+		{
+			char reason[32];
+			sprintf(reason, "$%04X = $%02X", address, value);
+			RequestStop(reason);
+		}
+	}
+}
+
+// Called at the end of every frame
+void CheckFrameConditions()
+{
+	if (frameCount >= stopFrame)
+		RequestStop("frame " + std::to_string(frameCount));
+
+	if (stopSeconds > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count() >= stopSeconds)
+		RequestStop("time limit");
+}
+
+// Runs until a condition is met, returns the number of instructions executed
+uint64_t RunUntilStopped()
+{
+	uint64_t instructions = 0;
+
+	runStart = std::chrono::steady_clock::now();
+	stopRequested = false;
+
+	if (stopOnPc)
+	{
+		while (!stopRequested && cycles < stopCycle && instructions < stopInstructions)
+		{
+			if (stopPcs[PC >> 3] & (1 << (PC & 0x07)))
+			{
+				char reason[16];
+				sprintf(reason, "PC $%04X", PC);
+				RequestStop(reason);
+				break;
+			}
+
+			Step();
+			++instructions;
+		}
+	}
+	else
+	{
+		while (!stopRequested && cycles < stopCycle && instructions < stopInstructions)
+		{
+			Step();
+			++instructions;
+		}
+	}
+
+	if (!stopRequested)
+		RequestStop(cycles >= stopCycle ? "cycle limit" : "instruction limit");
+
+	return instructions;
+}
+
+// Watchpoints
+// Reads and writes of watched addresses stop the run after the instruction that
+// made them. Only the pages holding watched addresses are trapped, accesses to
+// every other page stay on the fast path.
+
+struct Watchpoint
+{
+	uint16_t low;
+	uint16_t high;
+	uint8_t access; // TRAP_READ and/or TRAP_WRITE
+	int value; // Only hit when this value is read or written, -1 for any
+};
+
+std::vector<Watchpoint> watchpoints;
+uint16_t watchHitAddress; // Last watchpoint hit
+uint8_t watchHitAccess; // Its access type, 0 if none since it was cleared
+
+void AddWatchpoint(uint16_t low, uint16_t high, uint8_t access, int value)
+{
+	watchpoints.push_back({ low, high, access, value });
+
+	for (int page = low >> 8; page <= high >> 8; ++page)
+	{
+		pageTraps[page] |= access;
+	}
+
+	UpdatePages();
+}
+
+// Traps are shared, so removing one recomputes them from everything that traps pages
+void RebuildPageTraps()
+{
+	for (int page = 0; page < 256; ++page)
+	{
+		pageTraps[page] &= TRAP_CODE;
+	}
+
+	for (const TraceTrigger& trigger : traceWriteTriggers)
+	{
+		for (int page = trigger.low >> 8; page <= trigger.high >> 8; ++page)
+		{
+			pageTraps[page] |= TRAP_WRITE;
+		}
+	}
+
+	for (const MemoryCondition& condition : memoryConditions)
+	{
+		pageTraps[condition.address >> 8] |= TRAP_WRITE;
+	}
+
+	for (const Watchpoint& watchpoint : watchpoints)
+	{
+		for (int page = watchpoint.low >> 8; page <= watchpoint.high >> 8; ++page)
+		{
+			pageTraps[page] |= watchpoint.access;
+		}
+	}
+
+	UpdatePages();
+}
+
+void RemoveWatchpoint(uint16_t low, uint16_t high, uint8_t access)
+{
+	for (size_t i = 0; i < watchpoints.size(); ++i)
+	{
+		if (watchpoints[i].low == low && watchpoints[i].high == high && watchpoints[i].access == access)
+		{
+			watchpoints.erase(watchpoints.begin() + i);
+			break;
+		}
+	}
+
+	RebuildPageTraps();
+}
+
+// Called for accesses to trapped pages
+void CheckWatchpoints(uint16_t address, uint8_t value, uint8_t access)
+{
+	for (const Watchpoint& watchpoint : watchpoints)
+	{
+		if ((watchpoint.access & access) && address >= watchpoint.low && address <= watchpoint.high &&
+			(watchpoint.value < 0 || watchpoint.value == value))
+		{
+			char reason[64];
+			sprintf(reason, "%s $%04X = $%02X at PC $%04X", access == TRAP_READ ? "read" : "write", address, value, logAddress);
+			RequestStop(reason);
+
+			watchHitAddress = address;
+			watchHitAccess = watchpoint.access;
+		}
+	}
+}
+
+// Debugger
+// Commands are read from stdin or a script file:
+//   b addr[-addr]      set breakpoints        d addr[-addr]   delete breakpoints
+//   w/rw/aw addr[=v]   write/read/access watchpoint
+//   c                  continue               s [n]           step n instructions
+//   n                  step over a JSR        f               finish, run until RTS
+//   r                  show registers         m addr [len]    show memory
+//   q                  quit
+// Breakpoints are bits in the run condition PC bitmap, so continuing runs the
+// normal loop and only the PC checking loop while any breakpoint is set.
+
+// Reads without side effects, registers read as 0
+uint8_t PeekMemory(uint16_t address)
+{
+	uint8_t* page = memoryReadPages[address >> 8];
+
+	return page ? page[address & 0xFF] : 0;
+}
+
+bool IsBreakpoint(uint16_t address)
+{
+	return (stopPcs[address >> 3] & (1 << (address & 0x07))) != 0;
+}
+
+void PrintRegisters()
+{
+	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (1 << 5) | (V << 6) | (N << 7);
+	char line[96];
+
+	sprintf(line, "PC %04X A %02X, X %02X, Y %02X, SP %02X P %02X CYC: %llu", PC, A, X, Y, SP, P, static_cast<unsigned long long>(cycles));
+	cout << line << endl;
+}
+
+void PrintMemory(uint16_t address, uint32_t length)
+{
+	char line[8];
+
+	for (uint32_t i = 0; i < length; ++i)
+	{
+		if (i % 16 == 0)
+		{
+			if (i)
+				cout << endl;
+
+			sprintf(line, "%04X:", (address + i) & 0xFFFF);
+			cout << line;
+		}
+
+		sprintf(line, " %02X", PeekMemory((address + i) & 0xFFFF));
+		cout << line;
+	}
+
+	cout << endl;
+}
+
+// Runs one instruction and prints it in the trace format
+void DebugStep()
+{
+	TraceRecord record;
+	char line[MaxTraceLine];
+
+	BeginTraceRecord(record);
+	Step();
+	EndTraceRecord(record);
+
+	line[FormatTraceRecord(record, line)] = 0;
+	cout << line;
+}
+
+void DebugContinue()
+{
+	// Step off a breakpoint before running
+	stopRequested = false;
+	Step();
+
+	if (!stopRequested)
+		RunUntilStopped();
+}
+
+void DebugStepOver()
+{
+	if (PeekMemory(PC) != 0x20)
+	{
+		DebugStep();
+		return;
+	}
+
+	// Break on the return address, skipping hits from deeper recursion
+	uint16_t target = PC + 3;
+	uint8_t stackPointer = SP;
+	bool wasSet = IsBreakpoint(target);
+
+	if (!wasSet)
+		AddPcCondition(target, target);
+
+	do
+	{
+		DebugContinue();
+	} while (PC == target && SP != stackPointer && stopReason.compare(0, 2, "PC") == 0);
+
+	if (!wasSet)
+		RemovePcCondition(target, target);
+}
+
+void DebugFinish()
+{
+	uint8_t stackPointer = SP;
+	stopRequested = false;
+
+	for (;;)
+	{
+		bool returning = PeekMemory(PC) == 0x60;
+		Step();
+
+		if (returning && SP > stackPointer)
+		{
+			stopReason = "finished";
+			break;
+		}
+
+		if (stopRequested || IsBreakpoint(PC))
+		{
+			if (!stopRequested)
+				RequestStop("breakpoint");
+
+			break;
+		}
+	}
+}
+
+int RunDebugger(std::istream& input)
+{
+	std::string line;
+
+	PrintRegisters();
+
+	while (cout << "> " << std::flush, std::getline(input, line))
+	{
+		char command[16] = "";
+		char argument[64] = "";
+		char extra[64] = "";
+
+		if (sscanf(line.c_str(), "%15s %63s %63s", command, argument, extra) < 1)
+			continue;
+
+		uint16_t low, high;
+		int value;
+		bool hasRange = ParseAddressRange(argument, low, high, value);
+		std::string name(command);
+
+		if (name == "q")
+		{
+			break;
+		}
+		else if (name == "b" && hasRange)
+		{
+			AddPcCondition(low, high);
+		}
+		else if (name == "d" && hasRange)
+		{
+			RemovePcCondition(low, high);
+		}
+		else if ((name == "w" || name == "rw" || name == "aw") && hasRange)
+		{
+			uint8_t access = name == "w" ? TRAP_WRITE : name == "rw" ? TRAP_READ : TRAP_READ | TRAP_WRITE;
+			AddWatchpoint(low, high, access, value);
+		}
+		else if (name == "s")
+		{
+			unsigned long count = argument[0] ? strtoul(argument, nullptr, 10) : 1;
+			stopRequested = false;
+
+			for (unsigned long i = 0; i < count && !stopRequested; ++i)
+			{
+				DebugStep();
+			}
+
+			if (stopRequested)
+				cout << "Stopped: " << stopReason << endl;
+		}
+		else if (name == "c" || name == "n" || name == "f")
+		{
+			if (name == "c")
+				DebugContinue();
+			else if (name == "n")
+				DebugStepOver();
+			else
+				DebugFinish();
+
+			cout << "Stopped: " << stopReason << endl;
+			PrintRegisters();
+		}
+		else if (name == "r")
+		{
+			PrintRegisters();
+		}
+		else if (name == "m" && hasRange)
+		{
+			uint32_t length = extra[0] ? strtoul(extra, nullptr, 16) : high - low + 1;
+			PrintMemory(low, low == high && !extra[0] ? 16 : length);
+		}
+		else
+		{
+			cout << "Unknown command: " << line << endl;
+		}
+	}
+
+	return 0;
+}
+
+// GDB remote stub
+// Serves the GDB remote serial protocol on a localhost TCP port or a Unix
+// socket. Registers are sent in the order A, X, Y, SP, PC (16 bit, little
+// endian), P. Breakpoints set bits in the PC bitmap and watchpoints trap
+// pages, the same mechanisms the debugger uses, so the stub adds nothing to
+// the run loop. While running the socket is polled once per frame for an
+// interrupt.
+
+#ifndef _WIN32
+
+const uint64_t GdbPollCycles = 29781;
+
+int gdbSocket = -1;
+bool gdbNoAck;
+std::string gdbBuffer;
+
+// Returns the next byte from the client, -1 when the connection is gone
+int GdbReadByte()
+{
+	if (gdbBuffer.empty())
+	{
+		char data[1024];
+		ssize_t count = recv(gdbSocket, data, sizeof(data), 0);
+
+		if (count <= 0)
+			return -1;
+
+		gdbBuffer.assign(data, count);
+	}
+
+	uint8_t byte = gdbBuffer[0];
+	gdbBuffer.erase(0, 1);
+
+	return byte;
+}
+
+bool GdbSend(const std::string& payload)
+{
+	uint8_t checksum = 0;
+
+	for (char c : payload)
+	{
+		checksum += c;
+	}
+
+	char trailer[4];
+	sprintf(trailer, "#%02x", checksum);
+	std::string packet = "$" + payload + trailer;
+
+	for (;;)
+	{
+		if (send(gdbSocket, packet.data(), packet.size(), 0) != static_cast<ssize_t>(packet.size()))
+			return false;
+
+		if (gdbNoAck)
+			return true;
+
+		int ack = GdbReadByte();
+
+		if (ack == '+')
+			return true;
+		else if (ack != '-')
+			return false;
+	}
+}
+
+// Reads one packet, an interrupt outside a packet is returned as "\x03"
+bool GdbReceive(std::string& payload)
+{
+	int c;
+
+	do
+	{
+		c = GdbReadByte();
+
+		if (c == 0x03)
+		{
+			payload = "\x03";
+			return true;
+		}
+	} while (c >= 0 && c != '$');
+
+	payload.clear();
+
+	while ((c = GdbReadByte()) >= 0 && c != '#')
+	{
+		payload += static_cast<char>(c);
+	}
+
+	// Checksum, TCP already guarantees the data
+	if (c < 0 || GdbReadByte() < 0 || GdbReadByte() < 0)
+		return false;
+
+	if (!gdbNoAck)
+		send(gdbSocket, "+", 1, 0);
+
+	return true;
+}
+
+bool GdbInterrupted()
+{
+	pollfd descriptor = { gdbSocket, POLLIN, 0 };
+
+	while (gdbBuffer.empty() && poll(&descriptor, 1, 0) > 0)
+	{
+		char data[256];
+		ssize_t count = recv(gdbSocket, data, sizeof(data), 0);
+
+		if (count <= 0)
+			return true;
+
+		gdbBuffer.append(data, count);
+	}
+
+	size_t position = gdbBuffer.find('\x03');
+
+	if (position == std::string::npos)
+		return false;
+
+	gdbBuffer.erase(position, 1);
+	return true;
+}
+
+void AppendHex(std::string& out, uint32_t value, int bytes)
+{
+	char text[4];
+
+	// Little endian, as GDB expects target byte order
+	for (int i = 0; i < bytes; ++i)
+	{
+		sprintf(text, "%02x", (value >> (i * 8)) & 0xFF);
+		out += text;
+	}
+}
+
+uint32_t ParseHex(const std::string& text, size_t position, int bytes)
+{
+	uint32_t value = 0;
+
+	for (int i = 0; i < bytes && position + i * 2 + 2 <= text.size(); ++i)
+	{
+		value |= strtoul(text.substr(position + i * 2, 2).c_str(), nullptr, 16) << (i * 8);
+	}
+
+	return value;
+}
+
+std::string GdbRegisters()
+{
+	std::string out;
+	uint8_t P = C | (Z << 1) | (I << 2) | (D << 3) | (1 << 5) | (V << 6) | (N << 7);
+
+	AppendHex(out, A, 1);
+	AppendHex(out, X, 1);
+	AppendHex(out, Y, 1);
+	AppendHex(out, SP, 1);
+	AppendHex(out, PC, 2);
+	AppendHex(out, P, 1);
+
+	return out;
+}
+
+void SetStatus(uint8_t P)
+{
+	C = P & 0x01;
+	Z = (P >> 1) & 0x01;
+	I = (P >> 2) & 0x01;
+	D = (P >> 3) & 0x01;
+	V = (P >> 6) & 0x01;
+	N = (P >> 7) & 0x01;
+}
+
+void SetGdbRegister(int index, uint32_t value)
+{
+	switch (index)
+	{
+		case 0: A = value; break;
+		case 1: X = value; break;
+		case 2: Y = value; break;
+		case 3: SP = value; break;
+		case 4: PC = value; break;
+		case 5: SetStatus(value); break;
+	}
+}
+
+// Writes go to the memory behind a page, including ROM so GDB can patch code
+void PokeMemory(uint16_t address, uint8_t value)
+{
+	uint8_t* page = memoryWritePages[address >> 8];
+
+	if (page)
+	{
+		page[address & 0xFF] = value;
+		InvalidateCode(address);
+	}
+	else if (address >= 0x8000)
+	{
+		// ROM isn't tracked, patching it starts the cache over. The image is shared,
+		// so other states of the same cartridge see the patch too.
+		ROM[(address - 0x8000) & (prgSize - 1)] = value;
+		ResetDecodeCache();
+	}
+	else
+	{
+		WriteMemory(address, value);
+	}
+}
+
+std::string GdbStopReply(bool interrupted)
+{
+	if (interrupted)
+		return "S02";
+
+	if (watchHitAccess)
+	{
+		std::string reply = watchHitAccess == TRAP_WRITE ? "T05watch:" : watchHitAccess == TRAP_READ ? "T05rwatch:" : "T05awatch:";
+		char address[8];
+		sprintf(address, "%x;", watchHitAddress);
+
+		return reply + address;
+	}
+
+	return "S05";
+}
+
+std::string GdbContinue()
+{
+	bool interrupted = false;
+	uint64_t savedStopCycle = stopCycle;
+
+	watchHitAccess = 0;
+	stopRequested = false;
+	Step();
+
+	while (!stopRequested && cycles < savedStopCycle)
+	{
+		stopCycle = std::min(savedStopCycle, cycles + GdbPollCycles);
+		RunUntilStopped();
+		stopCycle = savedStopCycle;
+
+		if (stopReason == "cycle limit" && cycles < savedStopCycle)
+		{
+			if (GdbInterrupted())
+			{
+				interrupted = true;
+				break;
+			}
+
+			stopRequested = false;
+		}
+	}
+
+	return GdbStopReply(interrupted);
+}
+
+// Z and z packets: type,address,length
+std::string GdbBreakpoint(const std::string& packet)
+{
+	bool insert = packet[0] == 'Z';
+	int type = packet[1] - '0';
+	size_t comma = packet.find(',', 3);
+	uint16_t address = static_cast<uint16_t>(strtoul(packet.c_str() + 3, nullptr, 16));
+	uint32_t length = comma == std::string::npos ? 1 : strtoul(packet.c_str() + comma + 1, nullptr, 16);
+	uint16_t last = static_cast<uint16_t>(std::min<uint32_t>(0xFFFF, address + std::max<uint32_t>(length, 1) - 1));
+
+	if (type == 0 || type == 1)
+	{
+		// Software and hardware breakpoints are both PC bits
+		if (insert)
+			AddPcCondition(address, address);
+		else
+			RemovePcCondition(address, address);
+
+		return "OK";
+	}
+
+	static const uint8_t Access[] = { TRAP_WRITE, TRAP_READ, TRAP_READ | TRAP_WRITE };
+
+	if (type >= 2 && type <= 4)
+	{
+		if (insert)
+			AddWatchpoint(address, last, Access[type - 2], -1);
+		else
+			RemoveWatchpoint(address, last, Access[type - 2]);
+
+		return "OK";
+	}
+
+	return "";
+}
+
+std::string GdbHandle(const std::string& packet)
+{
+	char command = packet[0];
+
+	if (command == '?')
+	{
+		return "S05";
+	}
+	else if (command == 'g')
+	{
+		return GdbRegisters();
+	}
+	else if (command == 'G')
+	{
+		for (int i = 0; i < 6; ++i)
+		{
+			SetGdbRegister(i, ParseHex(packet, 1 + (i < 5 ? i * 2 : 12), i == 4 ? 2 : 1));
+		}
+
+		return "OK";
+	}
+	else if (command == 'p')
+	{
+		int index = strtol(packet.c_str() + 1, nullptr, 16);
+		std::string registers = GdbRegisters();
+
+		if (index < 0 || index > 5)
+			return "E01";
+
+		return index < 4 ? registers.substr(index * 2, 2) : index == 4 ? registers.substr(8, 4) : registers.substr(12, 2);
+	}
+	else if (command == 'P')
+	{
+		size_t equals = packet.find('=');
+
+		if (equals == std::string::npos)
+			return "E01";
+
+		int index = strtol(packet.c_str() + 1, nullptr, 16);
+		SetGdbRegister(index, ParseHex(packet, equals + 1, index == 4 ? 2 : 1));
+
+		return "OK";
+	}
+	else if (command == 'm' || command == 'M')
+	{
+		char* end;
+		uint32_t address = strtoul(packet.c_str() + 1, &end, 16);
+		uint32_t length = strtoul(end + 1, &end, 16);
+		std::string out;
+
+		for (uint32_t i = 0; i < length; ++i)
+		{
+			uint16_t target = (address + i) & 0xFFFF;
+
+			if (command == 'm')
+				AppendHex(out, PeekMemory(target), 1);
+			else
+				PokeMemory(target, ParseHex(packet, end + 1 - packet.c_str() + i * 2, 1));
+		}
+
+		return command == 'm' ? out : "OK";
+	}
+	else if (command == 'c')
+	{
+		return GdbContinue();
+	}
+	else if (command == 's')
+	{
+		watchHitAccess = 0;
+		stopRequested = false;
+		Step();
+
+		return GdbStopReply(false);
+	}
+	else if (command == 'Z' || command == 'z')
+	{
+		return GdbBreakpoint(packet);
+	}
+	else if (command == 'H')
+	{
+		return "OK";
+	}
+	else if (packet.compare(0, 10, "qSupported") == 0)
+	{
+		return "PacketSize=4000;QStartNoAckMode+;swbreak+;hwbreak+";
+	}
+	else if (packet == "QStartNoAckMode")
+	{
+		return "OK";
+	}
+	else if (packet == "qAttached")
+	{
+		return "1";
+	}
+
+	return "";
+}
+
+// Listens on a port number or a Unix socket path and serves one client
+int RunGdbServer(const char* address)
+{
+	int server;
+	char* end;
+	unsigned long port = strtoul(address, &end, 10);
+
+	if (*end == 0)
+	{
+		sockaddr_in local = {};
+		local.sin_family = AF_INET;
+		local.sin_port = htons(static_cast<uint16_t>(port));
+		local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		server = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if (server < 0 || bind(server, (sockaddr*)&local, sizeof(local)) < 0)
+		{
+			cout << "Can't listen on port " << port << endl;
+			return 1;
+		}
+	}
+	else
+	{
+		sockaddr_un local = {};
+		local.sun_family = AF_UNIX;
+		strncpy(local.sun_path, address, sizeof(local.sun_path) - 1);
+		unlink(address);
+
+		server = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		if (server < 0 || bind(server, (sockaddr*)&local, sizeof(local)) < 0)
+		{
+			cout << "Can't listen on " << address << endl;
+			return 1;
+		}
+	}
+
+	listen(server, 1);
+	cout << "Waiting for GDB on " << address << endl;
+
+	gdbSocket = accept(server, nullptr, nullptr);
+	close(server);
+
+	if (gdbSocket < 0)
+		return 1;
+
+	int noDelay = 1;
+	setsockopt(gdbSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	std::string packet;
+
+	while (GdbReceive(packet))
+	{
+		if (packet.empty() || packet == "\x03")
+			continue;
+
+		if (packet[0] == 'k')
+			break;
+
+		if (packet[0] == 'D')
+		{
+			GdbSend("OK");
+			break;
+		}
+
+		std::string reply = GdbHandle(packet);
+
+		if (!GdbSend(reply))
+			break;
+
+		if (packet == "QStartNoAckMode")
+			gdbNoAck = true;
+	}
+
+	close(gdbSocket);
+	gdbSocket = -1;
+
+	return 0;
+}
+
+#endif
 
-		// JMP
-	case 0x4C:
-		JMP(AbsoluteAddress());
-		break;
+// Regression runner
+// A manifest lists one "rom frames [input]" per line, paths relative to
+// the manifest. Each ROM is run for that many frames with the script's input
+// and its per frame framebuffer and RAM hashes are compared with rom.golden,
+// the same format -framehash writes. ROMs run in parallel in forked processes.
 
-	case 0x6C:
-		JMP(IndirectAddress());
-		break;
+struct RegressionEntry
+{
+	std::string rom;
+	uint64_t frames;
+	std::string inputScript;
+};
 
-		// JSR
-	case 0x20:
-		JSR(AbsoluteAddress());
-		break;
+enum RegressionResult
+{
+	REGRESSION_PASS,
+	REGRESSION_FAIL,
+	REGRESSION_ERROR
+};
 
-		// LDA
-	case 0xA9:
-		LDA(Immediate());
-		break;
-	case 0xA5:
-		LDA(ZeroPage());
-		break;
-	case 0xB5:
-		LDA(ZeroPageX());
-		break;
-	case 0xAD:
-		LDA(Absolute());
-		break;
-	case 0xBD:
-		LDA(AbsoluteX());
-		break;
-	case 0xB9:
-		LDA(AbsoluteY());
-		break;
-	case 0xA1:
-		LDA(IndirectX());
-		break;
-	case 0xB1:
-		LDA(IndirectY());
-		break;
+bool LoadRegressionManifest(const char* filename, std::vector<RegressionEntry>& entries)
+{
+	ifstream file(filename);
 
-		// LDX
-	case 0xA2:
-		LDX(Immediate());
-		break;
-	case 0xA6:
-		LDX(ZeroPage());
-		break;
-	case 0xB6:
-		LDX(ZeroPageY());
-		break;
-	case 0xAE:
-		LDX(Absolute());
-		break;
-	case 0xBE:
-		LDX(AbsoluteY());
-		break;
+	if (!file)
+		return false;
 
-		// LDY
-	case 0xA0:
-		LDY(Immediate());
-		break;
-	case 0xA4:
-		LDY(ZeroPage());
-		break;
-	case 0xB4:
-		LDY(ZeroPageX());
-		break;
-	case 0xAC:
-		LDY(Absolute());
-		break;
-	case 0xBC:
-		LDY(AbsoluteX());
-		break;
+	std::string directory(filename);
+	size_t slash = directory.find_last_of('/');
+	directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
 
-		// LSR
-	case 0x4A:
-		Implicit();
-		LSR_A();
-		break;
-	case 0x46:
-		LSR(ZeroPageAddress());
-		break;
-	case 0x56:
-		LSR(ZeroPageXAddress());
-		break;
-	case 0x4E:
-		LSR(AbsoluteAddress());
-		break;
-	case 0x5E:
-		LSR(AbsoluteXAddress());
-		break;
+	std::string line;
+	while (std::getline(file, line))
+	{
+		if (line.empty() || line[0] == '#')
+			continue;
 
-		// NOP
-	case 0xEA:
-		Implicit();
-		NOP();
-		break;
+		char rom[512];
+		char script[512] = "";
+		unsigned long long frames;
 
-		// ORA
-	case 0x09:
-		ORA(Immediate());
-		break;
-	case 0x05:
-		ORA(ZeroPage());
-		break;
-	case 0x15:
-		ORA(ZeroPageX());
-		break;
-	case 0x0D:
-		ORA(Absolute());
-		break;
-	case 0x1D:
-		ORA(AbsoluteX());
-		break;
-	case 0x19:
-		ORA(AbsoluteY());
-		break;
-	case 0x01:
-		ORA(IndirectX());
-		break;
-	case 0x11:
-		ORA(IndirectY());
-		break;
+		if (sscanf(line.c_str(), "%511s %llu %511s", rom, &frames, script) < 2)
+			continue;
 
-		// PHA
-	case 0x48:
-		Implicit();
-		PHA();
-		break;
+		RegressionEntry entry;
+		entry.rom = rom[0] == '/' ? rom : directory + rom;
+		entry.frames = frames;
 
-		// PHP
-	case 0x08:
-		Implicit();
-		PHP();
-		break;
+		if (script[0])
+			entry.inputScript = script[0] == '/' ? script : directory + script;
 
-		// PLA
-	case 0x68:
-		Implicit();
-		PLA();
-		break;
+		entries.push_back(entry);
+	}
+
+	return true;
+}
+
+// Runs one ROM from power on and checks or rewrites its golden file
+RegressionResult RunRegressionEntry(const RegressionEntry& entry, bool update, std::string& message)
+{
+	powerOnRamValue = 0;
+	inputScript.clear();
+	inputScriptPosition = 0;
+
+	if (!PowerOn(entry.rom.c_str()))
+	{
+		message = "can't load ROM";
+		return REGRESSION_ERROR;
+	}
+
+	if (!entry.inputScript.empty() && !LoadInput(entry.inputScript.c_str()))
+	{
+		message = "can't load input " + entry.inputScript;
+		return REGRESSION_ERROR;
+	}
+
+	std::string golden = entry.rom + ".golden";
+	HashFrameSink* sink = new HashFrameSink(update ? golden.c_str() : nullptr);
+	frameSinks.push_back(sink);
+
+	ApplyInputScript(1);
+	RunFrames(entry.frames);
+
+	std::vector<uint64_t> hashes = sink->hashes;
+	std::vector<uint64_t> ramHashes = sink->ramHashes;
+	CloseFrameSinks();
+
+	if (update)
+	{
+		message = "updated " + golden;
+		return REGRESSION_PASS;
+	}
+
+	ifstream file(golden);
+
+	if (!file)
+	{
+		message = "no golden file " + golden;
+		return REGRESSION_ERROR;
+	}
+
+	unsigned long long number, hash, ramHash;
+	size_t frame = 0;
+	std::string line;
+
+	while (std::getline(file, line) && sscanf(line.c_str(), "%llu %llx %llx", &number, &hash, &ramHash) == 3)
+	{
+		// Frames past the end of the run are only counted
+		if (frame < hashes.size() && (hashes[frame] != hash || ramHashes[frame] != ramHash))
+		{
+			message = "frame " + std::to_string(number) + (hashes[frame] != hash ? " framebuffer" : " RAM") + " differs";
+			return REGRESSION_FAIL;
+		}
+
+		++frame;
+	}
+
+	if (frame != hashes.size())
+	{
+		message = "golden file has " + std::to_string(frame) + " frames, the run has " + std::to_string(hashes.size());
+		return REGRESSION_FAIL;
+	}
+
+	message = std::to_string(frame) + " frames";
+	return REGRESSION_PASS;
+}
+
+void ReportRegression(const RegressionEntry& entry, RegressionResult result, const std::string& message)
+{
+	static const char* Labels[] = { "PASS", "FAIL", "ERROR" };
+
+	// One write per line so reports from parallel runs don't interleave
+	std::string line = std::string(Labels[result]) + " " + entry.rom + ": " + message + "\n";
+	fwrite(line.data(), 1, line.size(), stdout);
+	fflush(stdout);
+}
+
+int RunRegression(const char* manifest, int jobs, bool update)
+{
+	std::vector<RegressionEntry> entries;
+
+	if (!LoadRegressionManifest(manifest, entries))
+	{
+		cout << "Can't open " << manifest << endl;
+		return 1;
+	}
+
+	int failed = 0;
+
+#ifndef _WIN32
+	std::vector<std::pair<pid_t, size_t>> running; // Child and the entry it runs
+	size_t next = 0;
+
+	fflush(stdout);
+
+	while (next < entries.size() || !running.empty())
+	{
+		if (next < entries.size() && static_cast<int>(running.size()) < jobs)
+		{
+			// Load the cartridge before forking, children of repeated ROMs inherit the template
+			powerOnRamValue = 0;
+			PowerOn(entries[next].rom.c_str());
+
+			pid_t pid = fork();
+
+			if (pid == 0)
+			{
+				std::string message;
+				RegressionResult result = RunRegressionEntry(entries[next], update, message);
+				ReportRegression(entries[next], result, message);
+				_exit(result);
+			}
+
+			if (pid < 0)
+			{
+				ReportRegression(entries[next], REGRESSION_ERROR, "fork failed");
+				++failed;
+			}
+			else
+			{
+				running.push_back(std::make_pair(pid, next));
+			}
+
+			++next;
+			continue;
+		}
+
+		int status;
+		pid_t pid = wait(&status);
+
+		if (pid < 0)
+			break;
+
+		size_t entry = entries.size();
+
+		for (size_t i = 0; i < running.size(); ++i)
+		{
+			if (running[i].first == pid)
+			{
+				entry = running[i].second;
+				running.erase(running.begin() + i);
+				break;
+			}
+		}
+
+		// Children that exit have reported their result, one killed by a signal hasn't
+		if (!WIFEXITED(status) && entry < entries.size())
+			ReportRegression(entries[entry], REGRESSION_ERROR, "crashed (signal " + std::to_string(WTERMSIG(status)) + ")");
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != REGRESSION_PASS)
+			++failed;
+	}
+#else
+	(void)jobs;
+
+	for (const RegressionEntry& entry : entries)
+	{
+		std::string message;
+		RegressionResult result = RunRegressionEntry(entry, update, message);
+		ReportRegression(entry, result, message);
+
+		if (result != REGRESSION_PASS)
+			++failed;
+	}
+#endif
+
+	cout << entries.size() - failed << " of " << entries.size() << " passed" << endl;
+
+	return failed == 0 ? 0 : 1;
+}
+
+#ifndef _WIN32
+// Batch runner
+// Runs the jobs of a regression manifest in worker processes and collects what each run
+// ended with. Workers claim jobs from a counter in shared memory and write their results to
+// a shared table. Each worker keeps several runs in machines from the pool and switches
+// between them every few frames. When a worker crashes the launcher marks the job it was
+// running as crashed, puts the runs it had parked back in the queue and starts a replacement.
+enum BatchState
+{
+	BATCH_PENDING,
+	BATCH_RUNNING,
+	BATCH_PARKED, // In flight in a worker but not the one running
+	BATCH_DONE,
+	BATCH_ERROR,
+	BATCH_CRASHED
+};
+
+struct BatchResult
+{
+	std::atomic<int> state;
+	pid_t worker;
+	uint64_t frames;
+	uint64_t instructions;
+	uint64_t frameHash; // Last frame
+	uint64_t ramHash;
+	uint8_t saveStatus; // $6000, the status byte of test ROMs
+	char saveText[64]; // Text from $6004
+};
+
+struct BatchQueue
+{
+	std::atomic<uint32_t> next; // Next job to claim
+	uint32_t count;
+	BatchResult results[1]; // count entries
+};
+
+const int BatchMachines = 4; // Runs each worker keeps in flight
+const uint64_t BatchSlice = 8; // Frames a run gets before the worker moves on to the next
+
+struct BatchRun
+{
+	uint32_t job;
+	BatchResult* result;
+	MachineState* machine; // Null while the slot is free
+	HashFrameSink* sink;
+	std::vector<InputEvent> input;
+	size_t inputPosition;
+	uint64_t instructions;
+};
+
+// Jobs are claimed in order, then any a crashed worker had parked. Returns count when none are left.
+uint32_t ClaimBatchJob(BatchQueue* queue)
+{
+	for (uint32_t job = queue->next.fetch_add(1); job < queue->count; job = queue->next.fetch_add(1))
+	{
+		int pending = BATCH_PENDING;
+
+		if (queue->results[job].state.compare_exchange_strong(pending, BATCH_RUNNING))
+			return job;
+	}
+
+	for (uint32_t job = 0; job < queue->count; ++job)
+	{
+		int pending = BATCH_PENDING;
+
+		if (queue->results[job].state.compare_exchange_strong(pending, BATCH_RUNNING))
+			return job;
+	}
+
+	return queue->count;
+}
+
+// Claims jobs until one powers on, into a machine from the pool. Powering on replaces what
+// the emulator holds, so the running job has to be parked first.
+bool StartBatchRun(const std::vector<RegressionEntry>& entries, BatchQueue* queue, BatchRun& run)
+{
+	for (;;)
+	{
+		uint32_t job = ClaimBatchJob(queue);
+
+		if (job >= queue->count)
+			return false;
+
+		const RegressionEntry& entry = entries[job];
+		BatchResult& result = queue->results[job];
+		result.worker = getpid();
+
+		powerOnRamValue = 0;
+		inputScript.clear();
+		inputScriptPosition = 0;
+
+		if (!PowerOn(entry.rom.c_str()) || (!entry.inputScript.empty() && !LoadInput(entry.inputScript.c_str())))
+		{
+			result.state = BATCH_ERROR;
+			continue;
+		}
+
+		// The movie may have filled RAM, so the machine starts from what was loaded
+		run.job = job;
+		run.result = &result;
+		run.machine = AcquireMachine();
+		CaptureMachine(*run.machine);
+		run.sink = new HashFrameSink(nullptr);
+		run.input.swap(inputScript);
+		run.inputPosition = 0;
+		run.instructions = 0;
+		return true;
+	}
+}
+
+// Saves the running job's machine and input position
+void ParkBatchRun(BatchRun* run)
+{
+	if (!run)
+		return;
+
+	CaptureMachine(*run->machine);
+	run->input.swap(inputScript);
+	run->inputPosition = inputScriptPosition;
+	run->result->state = BATCH_PARKED;
+	frameSinks.clear();
+}
+
+// Continues a run where it left off, parking the one that was running
+void ResumeBatchRun(BatchRun* active, BatchRun& run)
+{
+	if (active == &run)
+		return;
+
+	if (active)
+	{
+		SwitchMachine(*active->machine, *run.machine);
+		active->input.swap(inputScript);
+		active->inputPosition = inputScriptPosition;
+		active->result->state = BATCH_PARKED;
+	}
+	else
+	{
+		RestoreMachine(*run.machine);
+	}
+
+	inputScript.swap(run.input);
+	inputScriptPosition = run.inputPosition;
+	run.result->state = BATCH_RUNNING;
+	frameSinks.assign(1, run.sink);
+	ApplyInputScript(frameCount + 1);
+}
+
+// Writes the result of the running job and returns its machine to the pool
+void FinishBatchRun(BatchRun& run, BatchResult& result)
+{
+	frameSinks.clear();
+
+	result.instructions = run.instructions;
+	result.frames = frameCount;
+
+	if (!run.sink->hashes.empty())
+	{
+		result.frameHash = run.sink->hashes.back();
+		result.ramHash = run.sink->ramHashes.back();
+	}
+
+	run.sink->Close();
+	delete run.sink;
 
-		// PLP
-	case 0x28:
-		Implicit();
-		PLP();
-		break;
+	result.saveStatus = SaveWorkRAM[0];
 
-		// ROL
-	case 0x2A:
-		Accumulator();
-		ROL_A();
-		break;
+	size_t length = 0;
+	while (length < sizeof(result.saveText) - 1 && isprint(SaveWorkRAM[4 + length]))
+	{
+		result.saveText[length] = SaveWorkRAM[4 + length];
+		++length;
+	}
 
-	case 0x26:
-		ROL(ZeroPageAddress());
-		break;
+	result.saveText[length] = 0;
+	result.state = BATCH_DONE;
 
-	case 0x36:
-		ROL(ZeroPageXAddress());
-		break;
+	ReleaseMachine(run.machine);
+	run.machine = nullptr;
+}
 
-	case 0x2E:
-		ROL(AbsoluteAddress());
-		break;
+pid_t StartBatchWorker(const std::vector<RegressionEntry>& entries, BatchQueue* queue)
+{
+	fflush(stdout);
 
-	case 0x3E:
-		ROL(AbsoluteXAddress());
-		break;
+	pid_t pid = fork();
 
-		// ROR
-	case 0x6A:
-		Accumulator();
-		ROR_A();
-		break;
+	if (pid != 0)
+		return pid;
 
-	case 0x66:
-		ROR(ZeroPageAddress());
-		break;
+	ReserveMachines(BatchMachines);
 
-	case 0x76:
-		ROR(ZeroPageXAddress());
-		break;
+	BatchRun runs[BatchMachines] = {};
+	BatchRun* active = nullptr;
+	bool claiming = true;
 
-	case 0x6E:
-		ROR(AbsoluteAddress());
-		break;
+	for (;;)
+	{
+		int live = 0;
 
-	case 0x7E:
-		ROR(AbsoluteXAddress());
-		break;
+		for (BatchRun& run : runs)
+		{
+			if (!run.machine && claiming)
+			{
+				ParkBatchRun(active);
+				active = nullptr;
+				claiming = StartBatchRun(entries, queue, run);
+			}
+
+			if (!run.machine)
+				continue;
+
+			++live;
+			ResumeBatchRun(active, run);
+			active = &run;
+
+			uint64_t frames = entries[run.job].frames;
+			run.instructions += RunFrames(std::min(BatchSlice, frames - std::min(frames, frameCount)));
+
+			if (frameCount >= frames)
+			{
+				FinishBatchRun(run, queue->results[run.job]);
+				active = nullptr;
+			}
+		}
 
-		// RTI
-	case 0x40:
-		Implicit();
-		RTI();
-		break;
+		if (live == 0)
+			break;
+	}
 
-		// RTS
-	case 0x60:
-		Implicit();
-		RTS();
-		break;
+	_exit(0);
+}
 
-		// SBC
-	case 0xE9:
-		SBC(Immediate());
-		break;
-	case 0xE5:
-		SBC(ZeroPage());
-		break;
-	case 0xF5:
-		SBC(ZeroPageX());
-		break;
-	case 0xED:
-		SBC(Absolute());
-		break;
-	case 0xFD:
-		SBC(AbsoluteX());
-		break;
-	case 0xF9:
-		SBC(AbsoluteY());
-		break;
-	case 0xE1:
-		SBC(IndirectX());
-		break;
-	case 0xF1:
-		SBC(IndirectY());
-		break;
+int RunBatch(const char* manifest, int workers)
+{
+	std::vector<RegressionEntry> entries;
 
-		// SEC
-	case 0x38:
-		Implicit();
-		SEC();
-		break;
+	if (!LoadRegressionManifest(manifest, entries))
+	{
+		cout << "Can't open " << manifest << endl;
+		return 1;
+	}
 
-		// SED
-	case 0xF8:
-		Implicit();
-		SED();
-		break;
+	if (entries.empty())
+		return 0;
 
-		// SEI
-	case 0x78:
-		Implicit();
-		SEI();
-		break;
+	size_t size = sizeof(BatchQueue) + (entries.size() - 1) * sizeof(BatchResult);
+	void* shared = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
 
-		// STA
-	case 0x85:
-		STA(ZeroPageAddress());
-		break;
-	case 0x95:
-		STA(ZeroPageXAddress());
-		break;
-	case 0x8D:
-		STA(AbsoluteAddress());
-		break;
-	case 0x9D:
-		STA(AbsoluteXAddress());
-		break;
-	case 0x99:
-		STA(AbsoluteYAddress());
-		break;
-	case 0x81:
-		STA(IndirectXAddress());
-		break;
-	case 0x91:
-		STA(IndirectYAddress());
-		break;
+	if (shared == MAP_FAILED)
+	{
+		cout << "Can't map the batch queue" << endl;
+		return 1;
+	}
 
-		// STX
-	case 0x86:
-		STX(ZeroPageAddress());
-		break;
-	case 0x96:
-		STX(ZeroPageYAddress());
-		break;
-	case 0x8E:
-		STX(AbsoluteAddress());
-		break;
+	// Anonymous mappings start zeroed, every job is pending
+	BatchQueue* queue = static_cast<BatchQueue*>(shared);
+	queue->count = entries.size();
 
-		// STY
-	case 0x84:
-		STY(ZeroPageAddress());
-		break;
-	case 0x94:
-		STY(ZeroPageXAddress());
-		break;
-	case 0x8C:
-		STY(AbsoluteAddress());
-		break;
+	int running = 0;
 
-		// TAX
-	case 0xAA:
-		Implicit();
-		TAX();
-		break;
+	for (int i = 0; i < workers && i < static_cast<int>(entries.size()); ++i)
+	{
+		if (StartBatchWorker(entries, queue) > 0)
+			++running;
+	}
 
-		// TAY
-	case 0xA8:
-		Implicit();
-		TAY();
-		break;
+	while (running > 0)
+	{
+		int status;
+		pid_t pid = wait(&status);
 
-		// TSX
-	case 0xBA:
-		Implicit();
-		TSX();
-		break;
+		if (pid < 0)
+			break;
 
-		// TXA
-	case 0x8A:
-		Implicit();
-		TXA();
-		break;
+		--running;
 
-		// TXS
-	case 0x9A:
-		Implicit();
-		TXS();
-		break;
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			continue;
 
-		// TYA (Transfer Y to Accumulator)
-	case 0x98:
-		Implicit();
-		TYA();
-		break;
+		// Only the job that was running is blamed, the parked ones run again
+		bool requeued = false;
 
-	default:
-		SetInstruction("UNKNOWN");
-		break;
+		for (uint32_t job = 0; job < queue->count; ++job)
+		{
+			BatchResult& result = queue->results[job];
+
+			if (result.worker != pid)
+				continue;
+
+			if (result.state == BATCH_RUNNING)
+			{
+				result.state = BATCH_CRASHED;
+			}
+			else if (result.state == BATCH_PARKED)
+			{
+				result.state = BATCH_PENDING;
+				requeued = true;
+			}
+		}
+
+		if ((queue->next < queue->count || requeued) && StartBatchWorker(entries, queue) > 0)
+			++running;
 	}
-}
 
-void Initialize()
-{
-	PC = 0;
-	SP = 0xFF;
-	A = 0;
-	C = 0;
-	Z = 0;
-	I = 0;
-	D = 0;
-	B = 0;
-	V = 0;
-	N = 0;
+	int failed = 0;
+	char line[256];
 
-	memset(RAM, 0, sizeof(RAM));
-	memset(ROM, 0, sizeof(ROM));
-}
+	for (uint32_t job = 0; job < queue->count; ++job)
+	{
+		const BatchResult& result = queue->results[job];
+		const RegressionEntry& entry = entries[job];
+		std::string name = entry.rom + (entry.inputScript.empty() ? "" : " " + entry.inputScript);
 
-uint16_t GetResetVector()
-{
-	uint16_t offset = 0x8000;
-	uint8_t low = ROM[0xfffc - offset];
-	uint8_t high = ROM[0xfffd - offset];
-	return low | (high << 8);
+		if (result.state == BATCH_DONE)
+		{
+			sprintf(line, ": %llu frames, %llu instructions, frame %016llx ram %016llx, status $%02X ",
+				static_cast<unsigned long long>(result.frames), static_cast<unsigned long long>(result.instructions),
+				static_cast<unsigned long long>(result.frameHash), static_cast<unsigned long long>(result.ramHash), result.saveStatus);
+			cout << name << line << result.saveText << endl;
+		}
+		else
+		{
+			cout << name << (result.state == BATCH_ERROR ? ": can't load" : result.state == BATCH_CRASHED ? ": crashed" : ": not run") << endl;
+			++failed;
+		}
+	}
+
+	munmap(shared, size);
+
+	return failed == 0 ? 0 : 1;
 }
+#endif
 
 int main(int argc, const char * argv[])
 {
 	Initialize();
-	
-	ifstream file;
-	file.open("official_only.nes", std::ios::binary);
-	//file.open("01-basics.nes", std::ios::binary);
-	//file.open("02-implied.nes", std::ios::binary);
-	//file.open("03-immediate.nes", std::ios::binary);
-	//file.open("04-zero_page.nes", std::ios::binary);
-	//file.open("06-absolute.nes", std::ios::binary);
-	//file.open("nestest.nes", std::ios::binary);
-
-	if (file)
-	{
-		// Skip the header
-		file.seekg(16, std::ios::beg);
-		file.read((char*)ROM, sizeof(ROM));
-	}
-
-	file.close();
+	BuildOutputPalettes();
+
+	const char* romFile = "official_only.nes";
+	//romFile = "01-basics.nes";
+	//romFile = "02-implied.nes";
+	//romFile = "03-immediate.nes";
+	//romFile = "04-zero_page.nes";
+	//romFile = "06-absolute.nes";
+	//romFile = "nestest.nes";
+
+	const char* traceFile = nullptr;
+	bool traceCompressed = false;
+	bool traceBinaryRecords = false;
+	bool disassemble = false;
+	bool analyze = false;
+	bool stats = false;
+	uint16_t rangeLow, rangeHigh;
+	int rangeValue;
+	const char* dumpPrefix = nullptr;
+	bool dumpPng = true;
+	const char* rawFile = nullptr;
+	PixelFormat rawFormat = PIXEL_RGBA8888;
+	uint64_t dumpFirst = 1;
+	uint64_t dumpLast = UINT64_MAX;
+	uint64_t dumpEvery = 1;
+	const char* regressManifest = nullptr;
+	const char* batchManifest = nullptr;
+	int regressJobs = std::max(1u, std::thread::hardware_concurrency());
+	bool regressUpdate = false;
+	bool debug = false;
+	const char* gdbAddress = nullptr;
+	const char* debugScript = nullptr;
+	const char* inputFile = nullptr;
+	const char* recordFile = nullptr;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-wav") == 0 && i + 1 < argc)
+			OpenWav(argv[++i]);
+		else if (strcmp(argv[i], "-cpu") == 0 && i + 1 < argc)
+		{
+			if (!SelectCpu(argv[++i]))
+			{
+				cout << "Unknown CPU: " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-cputest") == 0 && i + 1 < argc)
+			return RunCPUTests(argv[++i]) == 0 ? 0 : 1;
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc)
+			traceFile = argv[++i];
+		else if (strcmp(argv[i], "-tracelz") == 0)
+			traceCompressed = true;
+		else if (strcmp(argv[i], "-tracebin") == 0)
+			traceBinaryRecords = true;
+		else if (strcmp(argv[i], "-tracewait") == 0)
+			traceWait = true;
+		else if (strcmp(argv[i], "-symbols") == 0 && i + 1 < argc)
+			LoadSymbols(argv[++i]);
+		else if (strcmp(argv[i], "-disasm") == 0)
+			disassemble = true;
+		else if (strcmp(argv[i], "-analyze") == 0)
+			analyze = true;
+		else if (strcmp(argv[i], "-stats") == 0)
+			stats = true;
+		else if (strcmp(argv[i], "-tracestart") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddTracePcTrigger(TRACE_START, rangeLow, rangeHigh);
+		}
+		else if (strcmp(argv[i], "-tracestop") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddTracePcTrigger(TRACE_STOP, rangeLow, rangeHigh);
+		}
+		else if (strcmp(argv[i], "-tracewrite") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddTraceWriteTrigger(TRACE_START, rangeLow, rangeHigh, rangeValue);
+		}
+		else if (strcmp(argv[i], "-tracerange") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			traceWindowLow = rangeLow;
+			traceWindowHigh = rangeHigh;
+		}
+		else if (strcmp(argv[i], "-traceframe") == 0 && i + 1 < argc)
+			traceStartFrame = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-tracecount") == 0 && i + 1 < argc)
+			traceLimit = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-tracelast") == 0 && i + 1 < argc)
+			SetTraceHistory(strtoul(argv[++i], nullptr, 10));
+		else if (strcmp(argv[i], "-framehash") == 0 && i + 1 < argc)
+			frameSinks.push_back(new HashFrameSink(argv[++i]));
+		else if (strcmp(argv[i], "-rawframes") == 0 && i + 1 < argc)
+			rawFile = argv[++i];
+		else if (strcmp(argv[i], "-rawformat") == 0 && i + 1 < argc)
+		{
+			if (!ParsePixelFormat(argv[++i], rawFormat))
+			{
+				cout << "Unknown pixel format: " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-dump") == 0 && i + 1 < argc)
+			dumpPrefix = argv[++i];
+		else if (strcmp(argv[i], "-frameskip") == 0 && i + 1 < argc)
+			renderEvery = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-norender") == 0)
+			renderEvery = 0;
+		else if (strcmp(argv[i], "-dumpformat") == 0 && i + 1 < argc)
+			dumpPng = strcmp(argv[++i], "ppm") != 0;
+		else if (strcmp(argv[i], "-dumpframes") == 0 && i + 1 < argc)
+		{
+			char* end;
+			dumpFirst = dumpLast = strtoull(argv[++i], &end, 10);
+
+			if (*end == '-')
+				dumpLast = strtoull(end + 1, nullptr, 10);
+		}
+		else if (strcmp(argv[i], "-dumpevery") == 0 && i + 1 < argc)
+			dumpEvery = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-input") == 0 && i + 1 < argc)
+			inputFile = argv[++i];
+		else if (strcmp(argv[i], "-record") == 0 && i + 1 < argc)
+			recordFile = argv[++i];
+		else if (strcmp(argv[i], "-ramfill") == 0 && i + 1 < argc)
+			powerOnRamValue = static_cast<uint8_t>(strtoul(argv[++i], nullptr, 16));
+		else if (strcmp(argv[i], "-regress") == 0 && i + 1 < argc)
+			regressManifest = argv[++i];
+		else if (strcmp(argv[i], "-batch") == 0 && i + 1 < argc)
+			batchManifest = argv[++i];
+		else if (strcmp(argv[i], "-jobs") == 0 && i + 1 < argc)
+			regressJobs = std::max(1, atoi(argv[++i]));
+		else if (strcmp(argv[i], "-update") == 0)
+			regressUpdate = true;
+		else if (strcmp(argv[i], "-untilmem") == 0 && i + 1 < argc)
+		{
+			if (!AddMemoryCondition(argv[++i]))
+			{
+				cout << "Bad memory condition: " << argv[i] << endl;
+				return 1;
+			}
+		}
+		else if (strcmp(argv[i], "-untilpc") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddPcCondition(rangeLow, rangeHigh);
+		}
+		else if (strcmp(argv[i], "-watch") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddWatchpoint(rangeLow, rangeHigh, TRAP_WRITE, rangeValue);
+		}
+		else if (strcmp(argv[i], "-rwatch") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddWatchpoint(rangeLow, rangeHigh, TRAP_READ, rangeValue);
+		}
+		else if (strcmp(argv[i], "-awatch") == 0 && i + 1 < argc)
+		{
+			if (!ParseAddressRange(argv[++i], rangeLow, rangeHigh, rangeValue))
+			{
+				cout << "Bad address range: " << argv[i] << endl;
+				return 1;
+			}
+
+			AddWatchpoint(rangeLow, rangeHigh, TRAP_READ | TRAP_WRITE, rangeValue);
+		}
+		else if (strcmp(argv[i], "-gdb") == 0 && i + 1 < argc)
+			gdbAddress = argv[++i];
+		else if (strcmp(argv[i], "-debug") == 0)
+			debug = true;
+		else if (strcmp(argv[i], "-debugscript") == 0 && i + 1 < argc)
+			debugScript = argv[++i];
+		else if (strcmp(argv[i], "-untilframe") == 0 && i + 1 < argc)
+			stopFrame = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-untilcycle") == 0 && i + 1 < argc)
+			stopCycle = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-untilcount") == 0 && i + 1 < argc)
+			stopInstructions = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "-timeout") == 0 && i + 1 < argc)
+			stopSeconds = atof(argv[++i]);
+		else if (strcmp(argv[i], "-untrace") == 0 && i + 2 < argc)
+			return ConvertTrace(argv[i + 1], argv[i + 2]);
+		else
+			romFile = argv[i];
+	}
+
+	if (regressManifest)
+		return RunRegression(regressManifest, regressJobs, regressUpdate);
+
+	if (batchManifest)
+	{
+#ifndef _WIN32
+		return RunBatch(batchManifest, regressJobs);
+#else
+		cout << "The batch runner needs fork" << endl;
+		return 1;
+#endif
+	}
+
+	if (dumpPrefix)
+		frameSinks.push_back(new ImageFrameSink(dumpPrefix, dumpPng, dumpFirst, dumpLast, dumpEvery));
+
+	if (rawFile)
+		frameSinks.push_back(new RawFrameSink(rawFile, rawFormat));
+
+	// Power on again now the RAM value is known
+	Initialize();
+	LoadROM(romFile);
+
+	if (disassemble || analyze)
+	{
+		if (analyze)
+			PrintCodeAnalysis();
+
+		if (disassemble)
+			DisassembleROM(cout);
+
+		return 0;
+	}
+
+	if (inputFile && !LoadInput(inputFile))
+		return 1;
+
+	// Movies start from blank SaveWorkRAM, only free runs use the cart's save
+	if (loadedRom && loadedRom->battery && !inputFile && !recordFile && !OpenSaveFile(romFile))
+		return 1;
 
 	PC = GetResetVector();
+	ApplyInputScript(1);
 
-	logfile.open("log.txt", std::ios::trunc);
+	if (recordFile)
+	{
+		StartMovieRecording(recordFile);
+		RecordMovieFrame();
+	}
 
-	for (int i = 0; i < 10000000; ++i)
+	if (traceFile)
+		StartTrace(traceFile, traceCompressed, traceBinaryRecords);
+
+	if (gdbAddress)
+	{
+#ifndef _WIN32
+		RunGdbServer(gdbAddress);
+#else
+		cout << "The GDB stub needs POSIX sockets" << endl;
+#endif
+	}
+	else if (debugScript)
+	{
+		ifstream script(debugScript);
+		RunDebugger(script);
+	}
+	else if (debug)
+	{
+		RunDebugger(cin);
+	}
+	else
 	{
-		//sprintf(logStatusBuffer, "%c%c%c%c%c%c%c%c", N ? 'N' : 'n', V ? 'V' : 'v', 'U', 'B', D ? 'D' : 'd', I ? 'I' : 'i', Z ? 'Z' : 'z', C ? 'C' : 'c');
-		//sprintf(logAXY, "A %02x, X %02x, Y %02x, SP %02x", A, X, Y, SP);
+		// Without conditions run the old fixed budget
+		if (!stopOnPc && memoryConditions.empty() && watchpoints.empty() && stopCycle == UINT64_MAX &&
+			stopFrame == UINT64_MAX && stopInstructions == UINT64_MAX && stopSeconds == 0)
+		{
+			stopInstructions = 10000000;
+		}
 
-		ProcessInstruction();
+		uint64_t instructions = RunUntilStopped();
+		cout << "Stopped after " << instructions << " instructions, " << frameCount << " frames: " << stopReason << endl;
+	}
+
+	if (stats)
+	{
+		cout << decodeMisses << " instructions decoded, " << codeInvalidations << " invalidated by " << codeWriteHits << " writes to code" << endl;
 
-		//LogInstruction();
-		SimulatePPU();
+		if (tracing)
+			cout << traceDropped << " trace records dropped" << endl;
 	}
 
-	logfile.close();
+	StopTrace();
+	CloseWav();
+	CloseFrameSinks();
+	SaveMovie();
 
 	uint8_t low = ReadMemory(0x02);
 	uint8_t high = ReadMemory(0x03);
 	char error[32];
 	sprintf(error, "%2x%2x", high, low);
     cout << "Hello World!" << endl;
-	std::string results((char*)(SaveWorkRAM + 4));
+	const char* text = (const char*)(SaveWorkRAM + 4);
+	std::string results(text, strnlen(text, SaveWorkRAMSize - 4));
 	cout << results;
+	CloseSaveFile();
     cin.get();
     
     return 0;